@@ -0,0 +1,193 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <curl/curl.h>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// --- API Benchmark ---
+// Hammers a running webapp with keep-alive clients and prints requests/s and
+// latency percentiles per endpoint. Start the server with a resolver that
+// doesn't go to the internet, and queue links that fail fast, or the queue
+// just grows:
+//
+//   DOWNLOADER_RESOLVER=direct ./webapp &
+//   ./api_bench --clients 16 --seconds 5
+
+struct Endpoint {
+    std::string label;
+    std::string method;
+    std::string path;
+    std::string body;
+    std::string content_type;
+};
+
+struct BenchConfig {
+    std::string base = "http://127.0.0.1:18080";
+    int clients = 8;
+    double seconds = 5;
+    std::vector<Endpoint> endpoints;
+};
+
+static void usage() {
+    std::cout << "Usage: api_bench [options]\n"
+              << "  --base URL         server to test (default http://127.0.0.1:18080)\n"
+              << "  --clients N        concurrent keep-alive clients (default 8)\n"
+              << "  --seconds S        how long each endpoint runs (default 5)\n"
+              << "  --get PATH         benchmark GET PATH instead of the default set (repeatable)\n"
+              << "  --post PATH BODY   benchmark POST PATH with BODY (repeatable)\n";
+}
+
+// What the web UI and a status poller do most: queue one link, queue a
+// batch, look at a job, look at the metrics
+static std::vector<Endpoint> default_endpoints() {
+    // Port 9 (discard) refuses connections, so every queued job fails in microseconds
+    return {
+        {"POST /add_job", "POST", "/add_job", "url=http%3A%2F%2F127.0.0.1%3A9%2Fbench",
+         "application/x-www-form-urlencoded"},
+        {"POST /jobs (x10)", "POST", "/jobs",
+         "[\"http://127.0.0.1:9/a\",\"http://127.0.0.1:9/b\",\"http://127.0.0.1:9/c\",\"http://127.0.0.1:9/d\","
+         "\"http://127.0.0.1:9/e\",\"http://127.0.0.1:9/f\",\"http://127.0.0.1:9/g\",\"http://127.0.0.1:9/h\","
+         "\"http://127.0.0.1:9/i\",\"http://127.0.0.1:9/j\"]",
+         "application/json"},
+        {"GET /jobs/1", "GET", "/jobs/1", "", ""},
+        {"GET /metrics", "GET", "/metrics", "", ""},
+        {"GET /", "GET", "/", "", ""},
+    };
+}
+
+static bool parse_args(int argc, char* argv[], BenchConfig& config) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        auto next = [&](std::string& value) {
+            if (i + 1 >= argc) return false;
+            value = argv[++i];
+            return true;
+        };
+        std::string value;
+        if (arg == "--help") return false;
+        else if (!next(value)) return false;
+        else if (arg == "--base") config.base = value;
+        else if (arg == "--clients") config.clients = std::max(std::stoi(value), 1);
+        else if (arg == "--seconds") config.seconds = std::stod(value);
+        else if (arg == "--get") config.endpoints.push_back({"GET " + value, "GET", value, "", ""});
+        else if (arg == "--post") {
+            std::string body;
+            if (!next(body)) return false;
+            std::string type = body.size() && (body[0] == '[' || body[0] == '{') ? "application/json"
+                                                                                  : "application/x-www-form-urlencoded";
+            config.endpoints.push_back({"POST " + value, "POST", value, body, type});
+        }
+        else return false;
+    }
+    if (config.endpoints.empty()) config.endpoints = default_endpoints();
+    return true;
+}
+
+static size_t discard(char*, size_t size, size_t nmemb, void*) { return size * nmemb; }
+
+// --- 1. One Endpoint ---
+struct EndpointResult {
+    long long requests = 0;
+    long long errors = 0;     // transport errors and non-2xx answers
+    double seconds = 0;
+    std::vector<double> latencies_us;
+};
+
+static EndpointResult run_endpoint(const BenchConfig& config, const Endpoint& endpoint) {
+    std::string url = config.base + endpoint.path;
+    std::vector<EndpointResult> per_client(config.clients);
+    std::atomic<bool> stop{false};
+    auto started = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> clients;
+    for (int c = 0; c < config.clients; c++) {
+        clients.emplace_back([&, c] {
+            EndpointResult& result = per_client[c];
+            // One handle per client, so the connection is reused like a browser's
+            CURL* curl = curl_easy_init();
+            curl_slist* headers = nullptr;
+            if (!endpoint.content_type.empty()) {
+                headers = curl_slist_append(headers, ("Content-Type: " + endpoint.content_type).c_str());
+            }
+            curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, discard);
+            curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+            curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10L);
+            if (endpoint.method == "POST") {
+                curl_easy_setopt(curl, CURLOPT_POSTFIELDS, endpoint.body.c_str());
+                curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)endpoint.body.size());
+            }
+
+            while (!stop.load(std::memory_order_relaxed)) {
+                auto sent = std::chrono::steady_clock::now();
+                CURLcode rc = curl_easy_perform(curl);
+                auto done = std::chrono::steady_clock::now();
+                long code = 0;
+                curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+                result.requests++;
+                if (rc != CURLE_OK || code < 200 || code >= 300) result.errors++;
+                result.latencies_us.push_back(std::chrono::duration<double, std::micro>(done - sent).count());
+            }
+            curl_slist_free_all(headers);
+            curl_easy_cleanup(curl);
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(config.seconds));
+    stop = true;
+    for (std::thread& client : clients) client.join();
+
+    EndpointResult total;
+    total.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    for (EndpointResult& result : per_client) {
+        total.requests += result.requests;
+        total.errors += result.errors;
+        total.latencies_us.insert(total.latencies_us.end(), result.latencies_us.begin(), result.latencies_us.end());
+    }
+    std::sort(total.latencies_us.begin(), total.latencies_us.end());
+    return total;
+}
+
+static double percentile(const std::vector<double>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t index = std::min(sorted.size() - 1, (size_t)(p / 100.0 * sorted.size()));
+    return sorted[index];
+}
+
+// --- 2. Main ---
+int main(int argc, char* argv[]) {
+    BenchConfig config;
+    if (!parse_args(argc, argv, config)) {
+        usage();
+        return 1;
+    }
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+
+    std::cout << config.clients << " clients against " << config.base << ", " << config.seconds
+              << " s per endpoint\n\n";
+    std::cout << std::left << std::setw(20) << "endpoint" << std::right << std::setw(12) << "req/s"
+              << std::setw(12) << "p50 ms" << std::setw(12) << "p99 ms" << std::setw(12) << "max ms"
+              << std::setw(10) << "errors" << "\n";
+
+    bool all_ok = true;
+    for (const Endpoint& endpoint : config.endpoints) {
+        EndpointResult result = run_endpoint(config, endpoint);
+        const std::vector<double>& latencies = result.latencies_us;
+        std::cout << std::left << std::setw(20) << endpoint.label << std::right << std::fixed
+                  << std::setprecision(0) << std::setw(12) << result.requests / result.seconds
+                  << std::setprecision(3) << std::setw(12) << percentile(latencies, 50) / 1000
+                  << std::setw(12) << percentile(latencies, 99) / 1000
+                  << std::setw(12) << (latencies.empty() ? 0 : latencies.back() / 1000)
+                  << std::setw(10) << result.errors << "\n";
+        if (result.errors > 0 || result.requests == 0) all_ok = false;
+    }
+
+    curl_global_cleanup();
+    return all_ok ? 0 : 1;
+}
@@ -0,0 +1,73 @@
+#include "assets.h"
+
+#include <cstdlib>
+
+const EmbeddedAsset* find_asset(const std::string& name) {
+    // A handful of files; a map would cost more than it saves
+    for (size_t i = 0; i < EMBEDDED_ASSET_COUNT; i++) {
+        if (name == EMBEDDED_ASSETS[i].name) return &EMBEDDED_ASSETS[i];
+    }
+    return nullptr;
+}
+
+// If-None-Match: "a", W/"b" or *. Our ETags are strong, but a weak match is
+// enough to skip sending the body again. Each entry is compared whole (a tag
+// may hold commas, so they are read quote to quote).
+static bool etag_matches(const std::string& if_none_match, const std::string& etag) {
+    size_t pos = 0;
+    while (pos < if_none_match.size()) {
+        char c = if_none_match[pos];
+        if (c == ' ' || c == '\t' || c == ',') {
+            pos++;
+            continue;
+        }
+        if (c == '*') return true;
+        if (if_none_match.compare(pos, 2, "W/") == 0) pos += 2;
+        if (pos >= if_none_match.size() || if_none_match[pos] != '"') return false; // not a list we understand
+        size_t end = if_none_match.find('"', pos + 1);
+        if (end == std::string::npos) return false;
+        if (if_none_match.compare(pos, end + 1 - pos, etag) == 0) return true;
+        pos = end + 1;
+    }
+    return false;
+}
+
+// Accept-Encoding: gzip, deflate, br;q=0.9 ... but not "gzip;q=0"
+static bool accepts_gzip(const std::string& accept_encoding) {
+    size_t at = accept_encoding.find("gzip");
+    if (at == std::string::npos) return false;
+    size_t end = accept_encoding.find(',', at);
+    std::string params = accept_encoding.substr(at + 4, end == std::string::npos ? std::string::npos : end - at - 4);
+    size_t q = params.find("q=");
+    return q == std::string::npos || strtod(params.c_str() + q + 2, nullptr) > 0;
+}
+
+WebResponse asset_response(const WebRequest& request, const EmbeddedAsset* asset) {
+    if (!asset) return WebResponse(404, "Not found");
+
+    // The gzipped bytes are a different representation, so they get a tag of their own
+    bool gzip = accepts_gzip(request.header("Accept-Encoding"));
+    std::string etag = asset->etag;
+    if (gzip) etag.insert(etag.size() - 1, "-gz");
+
+    WebResponse response;
+    response.content_type = asset->content_type;
+    response.headers = {
+        {"ETag", etag},
+        // The browser keeps it but asks each time; the answer is nearly always a bodyless 304
+        {"Cache-Control", "no-cache"},
+        {"Vary", "Accept-Encoding"},
+    };
+    if (etag_matches(request.header("If-None-Match"), etag)) {
+        response.code = 304;
+        return response;
+    }
+
+    if (gzip) {
+        response.body.assign((const char*)asset->gzip, asset->gzip_size);
+        response.headers.emplace_back("Content-Encoding", "gzip");
+    } else {
+        response.body.assign((const char*)asset->data, asset->size);
+    }
+    return response;
+}
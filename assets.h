@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include "web_server.h"
+
+// --- Embedded UI ---
+// The files in ui/ are compiled into webapp (cmake/embed_assets.cmake), each
+// next to a copy gzipped at build time. Serving one is a memcpy: no disk,
+// no compression, and a 304 when the browser still has it.
+
+struct EmbeddedAsset {
+    const char* name; // path under ui/, e.g. "style.css"
+    const char* content_type;
+    const char* etag; // quoted, from the content's SHA-1
+    const unsigned char* data;
+    size_t size;
+    const unsigned char* gzip;
+    size_t gzip_size;
+};
+
+// Defined in the generated embedded_assets.cpp
+extern const EmbeddedAsset EMBEDDED_ASSETS[];
+extern const size_t EMBEDDED_ASSET_COUNT;
+
+// nullptr when ui/ has no such file
+const EmbeddedAsset* find_asset(const std::string& name);
+
+// 200 with the gzipped copy when the client takes gzip, the plain one
+// otherwise, or 304 when If-None-Match already names it. The gzipped copy's
+// ETag is the plain one's with -gz added. 404 for nullptr.
+WebResponse asset_response(const WebRequest& request, const EmbeddedAsset* asset);
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sched.h>
+#include <sys/mman.h>
+#include <thread>
+#include <vector>
+
+// --- Receive Buffer Pool ---
+// libcurl hands us data in small pieces (16KB at most per callback). Instead of
+// allocating for every piece, each download thread copies into big fixed-size
+// buffers carved out of slabs. Full buffers go to the writer stage, which gives
+// them back when they hit the disk. Once the slabs are warm, downloading does
+// not call malloc at all.
+
+constexpr size_t RECV_BUFFER_SIZE = 128 * 1024;
+constexpr size_t BUFFERS_PER_SLAB = 32;   // 4MB per slab
+constexpr size_t MAX_SLABS_PER_CACHE = 4; // past this, wait for the disk to catch up
+
+class BufferCache;
+
+struct RecvBuffer {
+    RecvBuffer* next = nullptr;   // link for the free lists and the writer queue
+    BufferCache* owner = nullptr; // the cache this buffer goes back to
+    void* target = nullptr;       // where the writer stage should put the bytes
+    size_t len = 0;
+    alignas(64) char data[RECV_BUFFER_SIZE];
+};
+
+// The NUMA node of the CPU we are running on (0 when the kernel can't tell us)
+inline unsigned current_numa_node() {
+    unsigned cpu = 0, node = 0;
+    if (getcpu(&cpu, &node) != 0) return 0;
+    return node;
+}
+
+// One cache per download thread. Only the owning thread takes buffers out, but
+// any thread (usually the writer) can give them back without a lock.
+class BufferCache {
+public:
+    explicit BufferCache(unsigned node) : node_(node) {}
+    BufferCache(const BufferCache&) = delete;
+    BufferCache& operator=(const BufferCache&) = delete;
+
+    ~BufferCache() {
+        for (void* slab : slabs_) munmap(slab, slab_bytes());
+    }
+
+    unsigned node() const { return node_; }
+
+    // Owner thread only
+    RecvBuffer* acquire() {
+        while (!local_) {
+            // Grab everything the writer gave back in one shot
+            local_ = returned_.exchange(nullptr, std::memory_order_acquire);
+            if (local_) break;
+
+            if (slabs_.size() < MAX_SLABS_PER_CACHE) {
+                add_slab();
+                break;
+            }
+
+            // Every buffer is queued for the disk. Back off until one comes home.
+            backpressure_events_.fetch_add(1, std::memory_order_relaxed);
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+
+        RecvBuffer* buffer = local_;
+        local_ = buffer->next;
+        buffer->next = nullptr;
+        buffer->target = nullptr;
+        buffer->len = 0;
+        return buffer;
+    }
+
+    // Any thread. A plain Treiber push is safe here because the owner never
+    // pops single nodes from this list, it always takes the whole thing.
+    void release(RecvBuffer* buffer) {
+        RecvBuffer* head = returned_.load(std::memory_order_relaxed);
+        do {
+            buffer->next = head;
+        } while (!returned_.compare_exchange_weak(head, buffer, std::memory_order_release,
+                                                  std::memory_order_relaxed));
+    }
+
+    long long backpressure_events() const {
+        return backpressure_events_.load(std::memory_order_relaxed);
+    }
+
+private:
+    static size_t slab_bytes() { return sizeof(RecvBuffer) * BUFFERS_PER_SLAB; }
+
+    void add_slab() {
+        void* memory = mmap(nullptr, slab_bytes(), PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) throw std::bad_alloc();
+
+        // Touch every page from this thread so the kernel's first-touch policy
+        // backs the slab with memory on our own NUMA node.
+        std::memset(memory, 0, slab_bytes());
+        slabs_.push_back(memory);
+
+        RecvBuffer* buffers = static_cast<RecvBuffer*>(memory);
+        for (size_t i = 0; i < BUFFERS_PER_SLAB; i++) {
+            RecvBuffer* buffer = new (&buffers[i]) RecvBuffer;
+            buffer->owner = this;
+            buffer->next = local_;
+            local_ = buffer;
+        }
+    }
+
+    unsigned node_;
+    RecvBuffer* local_ = nullptr;
+    std::atomic<RecvBuffer*> returned_{nullptr};
+    std::atomic<long long> backpressure_events_{0};
+    std::vector<void*> slabs_;
+};
+
+// Hands caches to threads. Download threads come and go with every segment,
+// so caches are kept here and reused instead of dying with their thread.
+class BufferPool {
+public:
+    BufferCache* attach() {
+        unsigned node = current_numa_node();
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        // Prefer a cache whose memory lives on the node we are running on
+        for (size_t i = 0; i < idle_.size(); i++) {
+            if (idle_[i]->node() == node) {
+                BufferCache* cache = idle_[i];
+                idle_[i] = idle_.back();
+                idle_.pop_back();
+                return cache;
+            }
+        }
+
+        caches_.push_back(std::make_unique<BufferCache>(node));
+        idle_.reserve(caches_.size());
+        return caches_.back().get();
+    }
+
+    void detach(BufferCache* cache) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        idle_.push_back(cache);
+    }
+
+    // Buffers always go back to the cache that handed them out
+    static void release(RecvBuffer* buffer) { buffer->owner->release(buffer); }
+
+    long long backpressure_events() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        long long total = 0;
+        for (auto& cache : caches_) total += cache->backpressure_events();
+        return total;
+    }
+
+private:
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<BufferCache>> caches_;
+    std::vector<BufferCache*> idle_;
+};
+
+inline BufferPool& recv_buffer_pool() {
+    static BufferPool pool;
+    return pool;
+}
+
+// Borrow a cache for the lifetime of a download thread
+class ScopedBufferCache {
+public:
+    ScopedBufferCache() : cache_(recv_buffer_pool().attach()) {}
+    ~ScopedBufferCache() { recv_buffer_pool().detach(cache_); }
+    ScopedBufferCache(const ScopedBufferCache&) = delete;
+    ScopedBufferCache& operator=(const ScopedBufferCache&) = delete;
+
+    BufferCache* get() const { return cache_; }
+
+private:
+    BufferCache* cache_;
+};
@@ -0,0 +1,80 @@
+# Turns the files of ui/ into constexpr byte arrays, each next to a gzipped
+# copy and an ETag, so webapp serves them without touching the disk or
+# compressing anything per request. Run by the build (see CMakeLists.txt):
+#
+#   cmake -DASSET_DIR=ui -DASSETS=index.html,style.css -DOUTPUT=embedded_assets.cpp -P embed_assets.cmake
+
+string(REPLACE "," ";" assets "${ASSETS}")
+get_filename_component(work_dir "${OUTPUT}" DIRECTORY)
+
+file(MAKE_DIRECTORY "${work_dir}/embedded_assets")
+
+# 16 bytes per line; CMake's regexes have no {16}
+set(line_of_bytes "")
+foreach(i RANGE 15)
+    string(APPEND line_of_bytes "0x..,")
+endforeach()
+
+set(arrays "")
+set(table "")
+foreach(asset IN LISTS assets)
+    set(path "${ASSET_DIR}/${asset}")
+    string(MAKE_C_IDENTIFIER "${asset}" name)
+
+    get_filename_component(extension "${asset}" LAST_EXT)
+    if(extension STREQUAL ".html")
+        set(content_type "text/html; charset=utf-8")
+    elseif(extension STREQUAL ".css")
+        set(content_type "text/css; charset=utf-8")
+    elseif(extension STREQUAL ".js")
+        set(content_type "text/javascript; charset=utf-8")
+    elseif(extension STREQUAL ".json")
+        set(content_type "application/json")
+    elseif(extension STREQUAL ".svg")
+        set(content_type "image/svg+xml")
+    elseif(extension STREQUAL ".png")
+        set(content_type "image/png")
+    elseif(extension STREQUAL ".ico")
+        set(content_type "image/x-icon")
+    else()
+        message(FATAL_ERROR "embed_assets: no content type for ${asset}")
+    endif()
+
+    set(gzipped "${work_dir}/embedded_assets/${asset}.gz")
+    file(ARCHIVE_CREATE OUTPUT "${gzipped}" PATHS "${path}" FORMAT raw COMPRESSION GZip COMPRESSION_LEVEL 9)
+
+    # The ETag only changes with the content, not with the build
+    file(SHA1 "${path}" digest)
+    string(SUBSTRING "${digest}" 0 16 etag)
+
+    foreach(variant raw gz)
+        if(variant STREQUAL "raw")
+            file(READ "${path}" hex HEX)
+            set(array "${name}")
+        else()
+            file(READ "${gzipped}" hex HEX)
+            set(array "${name}_gz")
+        endif()
+        if(hex STREQUAL "")
+            message(FATAL_ERROR "embed_assets: ${asset} is empty")
+        endif()
+        string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," bytes "${hex}")
+        string(REGEX REPLACE "(${line_of_bytes})" "\\1\n    " bytes "${bytes}")
+        string(APPEND arrays "constexpr unsigned char ${array}[] = {\n    ${bytes}\n};\n")
+    endforeach()
+
+    string(APPEND table "    {\"${asset}\", \"${content_type}\", \"\\\"${etag}\\\"\", ${name}, sizeof(${name}), ${name}_gz, sizeof(${name}_gz)},\n")
+endforeach()
+
+list(LENGTH assets count)
+file(WRITE "${OUTPUT}"
+"// Generated from ui/ by cmake/embed_assets.cmake; edit the files there instead.
+#include \"assets.h\"
+
+namespace {
+${arrays}} // namespace
+
+extern constexpr EmbeddedAsset EMBEDDED_ASSETS[] = {
+${table}};
+extern constexpr size_t EMBEDDED_ASSET_COUNT = ${count};
+")
@@ -0,0 +1,219 @@
+#include "dns_cache.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <netdb.h>
+#include <resolv.h>
+#include <set>
+#include <thread>
+
+constexpr int DNS_DEFAULT_TTL = 60;  // seconds, when DNS doesn't back getaddrinfo()'s answer
+constexpr int DNS_MAX_TTL = 3600;    // don't trust a record longer than this
+constexpr int DNS_NEGATIVE_TTL = 5;  // a host that didn't resolve isn't asked again for this long
+
+struct DnsEntry {
+    std::vector<std::string> addresses;
+    std::set<std::string> unreachable;
+    std::chrono::steady_clock::time_point expires;
+    bool fixed = false; // from dns_add_static
+};
+
+struct DnsCache {
+    std::mutex mutex;
+    std::map<std::string, DnsEntry> entries;
+
+    // Background lookups for dns_prefetch
+    std::condition_variable cv;
+    std::deque<std::string> queue;
+    std::set<std::string> in_flight;
+    bool thread_started = false;
+};
+
+static DnsCache& cache() {
+    static DnsCache* instance = new DnsCache; // the prefetch thread never exits
+    return *instance;
+}
+
+// --- 1. Lookups ---
+// URLs put IPv6 addresses in brackets: http://[::1]:8080/
+static bool is_ip_literal(const std::string& host) {
+    std::string address = host;
+    if (address.size() > 2 && address.front() == '[' && address.back() == ']') {
+        address = address.substr(1, address.size() - 2);
+    }
+    unsigned char buffer[sizeof(in6_addr)];
+    return inet_pton(AF_INET, address.c_str(), buffer) == 1 || inet_pton(AF_INET6, address.c_str(), buffer) == 1;
+}
+
+// One record type straight from the DNS servers, so we get to see the TTL.
+// CNAMEs on the way count too: the answer is only good as long as all of them.
+static void query_records(const std::string& host, int type, std::vector<std::string>& out, long& ttl) {
+    struct __res_state state;
+    memset(&state, 0, sizeof(state));
+    if (res_ninit(&state) != 0) return;
+
+    unsigned char answer[4096];
+    int len = res_nquery(&state, host.c_str(), ns_c_in, type, answer, sizeof(answer));
+    res_nclose(&state);
+    if (len < 0) return;
+
+    ns_msg msg;
+    if (ns_initparse(answer, len, &msg) < 0) return;
+    for (int i = 0; i < ns_msg_count(msg, ns_s_an); i++) {
+        ns_rr rr;
+        if (ns_parserr(&msg, ns_s_an, i, &rr) < 0) continue;
+        ttl = std::min<long>(ttl, ns_rr_ttl(rr));
+        if (ns_rr_type(rr) != type) continue;
+
+        char text[INET6_ADDRSTRLEN];
+        int family = type == ns_t_a ? AF_INET : AF_INET6;
+        if (inet_ntop(family, ns_rr_rdata(rr), text, sizeof(text))) out.push_back(text);
+    }
+}
+
+static void getaddrinfo_records(const std::string& host, std::vector<std::string>& v4, std::vector<std::string>& v6) {
+    addrinfo hints = {};
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* result = nullptr;
+    if (getaddrinfo(host.c_str(), nullptr, &hints, &result) != 0) return;
+
+    for (addrinfo* ai = result; ai; ai = ai->ai_next) {
+        char text[INET6_ADDRSTRLEN];
+        if (ai->ai_family == AF_INET) {
+            inet_ntop(AF_INET, &((sockaddr_in*)ai->ai_addr)->sin_addr, text, sizeof(text));
+            if (std::find(v4.begin(), v4.end(), text) == v4.end()) v4.push_back(text);
+        } else if (ai->ai_family == AF_INET6) {
+            inet_ntop(AF_INET6, &((sockaddr_in6*)ai->ai_addr)->sin6_addr, text, sizeof(text));
+            if (std::find(v6.begin(), v6.end(), text) == v6.end()) v6.push_back(text);
+        }
+    }
+    freeaddrinfo(result);
+}
+
+static bool contains_all(const std::vector<std::string>& have, const std::vector<std::string>& wanted) {
+    for (const std::string& address : wanted) {
+        if (std::find(have.begin(), have.end(), address) == have.end()) return false;
+    }
+    return true;
+}
+
+// The addresses are getaddrinfo()'s, as curl's would be, so /etc/hosts and
+// nsswitch get their say. The DNS servers are asked only how long those
+// addresses hold; when they don't know the name or give different answers
+// (a hosts file override, split horizon) the default TTL goes instead.
+static DnsEntry resolve(const std::string& host) {
+    std::vector<std::string> v4, v6;
+    getaddrinfo_records(host, v4, v6);
+
+    // Nothing: kept as an empty entry for a while, so a host that doesn't
+    // resolve costs one round of lookups, not one per segment and retry
+    long ttl = DNS_NEGATIVE_TTL;
+    if (!v4.empty() || !v6.empty()) {
+        std::vector<std::string> dns_v4, dns_v6;
+        long dns_ttl = DNS_MAX_TTL;
+        query_records(host, ns_t_aaaa, dns_v6, dns_ttl);
+        query_records(host, ns_t_a, dns_v4, dns_ttl);
+        bool same = !(dns_v4.empty() && dns_v6.empty()) && contains_all(dns_v4, v4) && contains_all(dns_v6, v6);
+        ttl = same ? dns_ttl : DNS_DEFAULT_TTL;
+    }
+
+    // v6, v4, v6, v4, ... so neighbouring segments land on different families
+    // too, and one broken family never takes out every segment.
+    DnsEntry entry;
+    for (size_t i = 0; i < std::max(v4.size(), v6.size()); i++) {
+        if (i < v6.size()) entry.addresses.push_back(v6[i]);
+        if (i < v4.size()) entry.addresses.push_back(v4[i]);
+    }
+    entry.expires = std::chrono::steady_clock::now() + std::chrono::seconds(ttl);
+    return entry;
+}
+
+static std::vector<std::string> usable(const DnsEntry& entry) {
+    std::vector<std::string> result;
+    for (const std::string& address : entry.addresses) {
+        if (!entry.unreachable.count(address)) result.push_back(address);
+    }
+    return result;
+}
+
+static bool fresh(const DnsEntry& entry) {
+    return entry.fixed || entry.expires > std::chrono::steady_clock::now();
+}
+
+std::vector<std::string> dns_lookup(const std::string& host) {
+    if (host.empty() || is_ip_literal(host)) return {};
+    DnsCache& c = cache();
+    {
+        std::lock_guard<std::mutex> lock(c.mutex);
+        auto it = c.entries.find(host);
+        if (it != c.entries.end() && fresh(it->second)) return usable(it->second);
+    }
+
+    // Two threads may look up the same host at once; both answers are good
+    DnsEntry entry = resolve(host);
+    std::lock_guard<std::mutex> lock(c.mutex);
+    c.entries[host] = entry;
+    return usable(entry);
+}
+
+void dns_mark_unreachable(const std::string& host, const std::string& address) {
+    DnsCache& c = cache();
+    std::lock_guard<std::mutex> lock(c.mutex);
+    auto it = c.entries.find(host);
+    if (it != c.entries.end()) it->second.unreachable.insert(address);
+}
+
+void dns_add_static(const std::string& host, const std::vector<std::string>& addresses) {
+    DnsCache& c = cache();
+    std::lock_guard<std::mutex> lock(c.mutex);
+    DnsEntry& entry = c.entries[host];
+    entry.addresses = addresses;
+    entry.unreachable.clear();
+    entry.fixed = true;
+}
+
+// --- 2. Prefetching ---
+static void prefetch_loop() {
+    DnsCache& c = cache();
+    while (true) {
+        std::string host;
+        {
+            std::unique_lock<std::mutex> lock(c.mutex);
+            c.cv.wait(lock, [&]{ return !c.queue.empty(); });
+            host = c.queue.front();
+            c.queue.pop_front();
+        }
+
+        DnsEntry entry = resolve(host);
+
+        std::lock_guard<std::mutex> lock(c.mutex);
+        c.entries[host] = entry;
+        c.in_flight.erase(host);
+    }
+}
+
+void dns_prefetch(const std::string& host) {
+    if (host.empty() || is_ip_literal(host)) return;
+    DnsCache& c = cache();
+    {
+        std::lock_guard<std::mutex> lock(c.mutex);
+        auto it = c.entries.find(host);
+        if (it != c.entries.end() && fresh(it->second)) return;
+        if (!c.in_flight.insert(host).second) return;
+        c.queue.push_back(host);
+
+        // One thread is plenty: lookups are short, and it is only ever ahead of the queue
+        if (!c.thread_started) {
+            c.thread_started = true;
+            std::thread(prefetch_loop).detach();
+        }
+    }
+    c.cv.notify_one();
+}
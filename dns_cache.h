@@ -0,0 +1,32 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// --- DNS Cache ---
+// One lookup per host for as long as its records say (their TTL), shared by
+// every job and every segment. libcurl keeps its own DNS cache too, but with
+// a fixed timeout and nothing we can hand out to individual segments; this
+// one gives the engine the full address list so it can spread segments over
+// them (see Download::setup_transfer).
+//
+// Addresses come from getaddrinfo(), so /etc/hosts and nsswitch count just
+// as they do for curl. The DNS servers from /etc/resolv.conf are asked as
+// well, only for the TTL; names they don't know or answer differently for
+// get a default one.
+
+// Addresses for `host`, IPv6 and IPv4 interleaved. Blocks on a lookup unless
+// the cache has a fresh answer. IP literals (bracketed or not) and unknown
+// hosts give an empty list; unknown ones stay that way for a few seconds.
+std::vector<std::string> dns_lookup(const std::string& host);
+
+// Starts a lookup in the background so dns_lookup() finds it cached later.
+// Cheap to call for every queued job: fresh and in-flight hosts are skipped.
+void dns_prefetch(const std::string& host);
+
+// A connection to this address failed. It is left out of the host's list
+// until the next lookup.
+void dns_mark_unreachable(const std::string& host, const std::string& address);
+
+// Fixed addresses for a host, like curl's --resolve. They never expire.
+void dns_add_static(const std::string& host, const std::vector<std::string>& addresses);
@@ -0,0 +1,268 @@
+#include "download_cache.h"
+
+#include <cstdio>
+#include <dirent.h>
+#include <fstream>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "downloader.h"
+#include "metrics.h"
+#include "sha256.h"
+
+// --- 1. Keys ---
+static std::string cache_key(const std::vector<std::string>& urls) {
+    std::string key;
+    for (const std::string& url : urls) key += normalize_url(url) + "\n";
+    return key;
+}
+
+// --- 2. The Index ---
+// One entry per line: hash, then url, etag and last_modified for every
+// source, all separated by tabs (none of them can hold one)
+DownloadCache::DownloadCache(std::string dir, long long max_bytes) : dir_(std::move(dir)), max_bytes_(max_bytes) {
+    mkdir(dir_.c_str(), 0755);
+    mkdir((dir_ + "/objects").c_str(), 0755);
+    std::lock_guard<std::mutex> lock(mutex_);
+    load();
+}
+
+void DownloadCache::load() {
+    std::ifstream index(dir_ + "/index");
+    std::string line;
+    while (std::getline(index, line)) {
+        if (line.empty()) continue;
+        std::vector<std::string> fields;
+        std::stringstream stream(line);
+        for (std::string field; std::getline(stream, field, '\t');) fields.push_back(field);
+        if (line.back() == '\t') fields.push_back(""); // getline drops an empty last field
+        if (fields.size() < 4 || (fields.size() - 1) % 3 != 0 || fields[0].size() != 64) continue;
+
+        struct stat info;
+        const std::string& hash = fields[0];
+        if (!objects_.count(hash)) {
+            if (stat(object_path(hash).c_str(), &info) != 0) continue; // lost; the entry goes too
+            objects_[hash].size = info.st_size;
+            bytes_ += info.st_size;
+        }
+        Entry entry;
+        entry.hash = hash;
+        std::vector<std::string> urls;
+        for (size_t i = 1; i < fields.size(); i += 3) {
+            entry.sources.push_back({fields[i], fields[i + 1], fields[i + 2]});
+            urls.push_back(fields[i]);
+        }
+        std::string key = cache_key(urls);
+        if (entries_.count(key)) drop(key); // the later line is the newer one
+        entry.position = lru_.insert(lru_.end(), key);
+        objects_[hash].entries++;
+        entries_[key] = std::move(entry);
+    }
+
+    // Whatever the index doesn't point at is left over from a crash
+    if (DIR* objects = opendir((dir_ + "/objects").c_str())) {
+        while (dirent* file = readdir(objects)) {
+            std::string name = file->d_name;
+            if (name[0] == '.') continue;
+            auto object = objects_.find(name);
+            if (object == objects_.end() || object->second.entries == 0) {
+                if (object != objects_.end()) {
+                    bytes_ -= object->second.size;
+                    objects_.erase(object);
+                }
+                unlink(object_path(name).c_str());
+            }
+        }
+        closedir(objects);
+    }
+    evict();
+    save();
+}
+
+void DownloadCache::save() const {
+    std::string path = dir_ + "/index";
+    std::ofstream index(path + ".tmp", std::ios::trunc);
+    for (const std::string& key : lru_) {
+        const Entry& entry = entries_.at(key);
+        index << entry.hash;
+        for (const CacheSource& source : entry.sources) {
+            index << '\t' << source.url << '\t' << source.etag << '\t' << source.last_modified;
+        }
+        index << '\n';
+    }
+    index.close();
+    if (index.good()) rename((path + ".tmp").c_str(), path.c_str());
+}
+
+// Forgets the entry, and its file once no entry points at it
+void DownloadCache::drop(const std::string& key) {
+    auto it = entries_.find(key);
+    if (it == entries_.end()) return;
+    auto object = objects_.find(it->second.hash);
+    if (object != objects_.end() && --object->second.entries == 0) {
+        unlink(object_path(object->first).c_str());
+        bytes_ -= object->second.size;
+        objects_.erase(object);
+    }
+    lru_.erase(it->second.position);
+    entries_.erase(it);
+}
+
+void DownloadCache::evict() {
+    while (bytes_ > max_bytes_ && !lru_.empty()) drop(lru_.front());
+}
+
+long long DownloadCache::size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return bytes_;
+}
+
+// --- 3. Fetch and Store ---
+long long DownloadCache::fetch(const std::vector<std::string>& urls, const std::string& output) {
+    std::string key = cache_key(urls);
+    Entry entry;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(key);
+        if (it != entries_.end()) entry = it->second;
+    }
+    if (entry.hash.empty()) {
+        metrics_add(MetricCounter::CacheMisses);
+        return -1;
+    }
+
+    // The servers are asked without the lock held; someone may have replaced the entry meanwhile
+    auto forget = [&] {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(key);
+        if (it != entries_.end() && it->second.hash == entry.hash) {
+            drop(key);
+            save();
+        }
+    };
+    for (size_t i = 0; i < urls.size(); i++) {
+        if (!still_current(urls[i], entry.sources[i].etag, entry.sources[i].last_modified)) {
+            forget();
+            metrics_add(MetricCounter::CacheMisses);
+            return -1;
+        }
+    }
+
+    std::string object = object_path(entry.hash);
+    struct stat info;
+    if (!clone_into_place(object, output) || stat(output.c_str(), &info) != 0) {
+        if (access(object.c_str(), F_OK) != 0) forget(); // evicted meanwhile, or lost
+        metrics_add(MetricCounter::CacheMisses);
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+        lru_.splice(lru_.end(), lru_, it->second.position);
+        save();
+    }
+    metrics_add(MetricCounter::CacheHits);
+    return info.st_size;
+}
+
+std::shared_ptr<PreviousCopy> DownloadCache::previous(const std::string& url, const std::string& path) {
+    auto copy = std::make_shared<PreviousCopy>();
+    std::string object;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(cache_key({url}));
+        if (it == entries_.end()) return nullptr;
+        object = object_path(it->second.hash);
+        copy->etag = it->second.sources[0].etag;
+        copy->last_modified = it->second.sources[0].last_modified;
+    }
+    // Outside the lock: across file systems this is a full copy. If the
+    // object got evicted meanwhile there is simply no previous copy.
+    copy->path = path;
+    unlink(path.c_str());
+    if (!clone_file(object, path)) return nullptr;
+    return copy;
+}
+
+bool DownloadCache::has(const std::string& url) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.count(cache_key({url})) != 0;
+}
+
+void DownloadCache::used(const std::string& url, bool current) {
+    metrics_add(current ? MetricCounter::CacheHits : MetricCounter::CacheMisses);
+    if (!current) return;
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(cache_key({url}));
+    if (it != entries_.end()) {
+        lru_.splice(lru_.end(), lru_, it->second.position);
+        save();
+    }
+}
+
+bool DownloadCache::store(const std::vector<CacheSource>& sources, const std::string& output) {
+    if (sources.empty()) return false;
+    for (const CacheSource& source : sources) {
+        if (source.etag.empty() && source.last_modified.empty()) return false;
+    }
+    struct stat info;
+    if (stat(output.c_str(), &info) != 0 || info.st_size > max_bytes_) return false;
+    std::string hash = sha256_file(output);
+    if (hash.empty()) return false;
+
+    std::vector<std::string> urls;
+    for (const CacheSource& source : sources) urls.push_back(source.url);
+    std::string key = cache_key(urls);
+
+    auto same_bytes = [&] {
+        auto it = entries_.find(key);
+        if (it == entries_.end() || it->second.hash != hash) return false;
+        // Same bytes as before, newer validators
+        it->second.sources = sources;
+        lru_.splice(lru_.end(), lru_, it->second.position);
+        save();
+        return true;
+    };
+    bool have_object;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (same_bytes()) return true;
+        have_object = objects_.count(hash) != 0;
+    }
+
+    // A copy of its own, never a hard link: that would make the caller's
+    // output read-only and let writes to it change the cached file. Made
+    // without the lock held, since it may have to move every byte.
+    std::string path = object_path(hash);
+    std::string temp = path + ".tmp" + std::to_string(next_temp_++);
+    if (!have_object) {
+        if (!copy_file(output, temp)) return false;
+        chmod(temp.c_str(), 0444);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (same_bytes()) {
+        unlink(temp.c_str());
+        return true;
+    }
+    if (objects_.count(hash)) {
+        unlink(temp.c_str()); // filed by someone else meanwhile
+    } else if (have_object || rename(temp.c_str(), path.c_str()) != 0) {
+        unlink(temp.c_str()); // evicted meanwhile, or the rename failed
+        return false;
+    } else {
+        objects_[hash].size = info.st_size;
+        bytes_ += info.st_size;
+    }
+    objects_[hash].entries++; // before drop(), which may have been the last one pointing at it
+    drop(key);
+
+    Entry& entry = entries_[key];
+    entry.sources = sources;
+    entry.hash = hash;
+    entry.position = lru_.insert(lru_.end(), key);
+    evict();
+    save();
+    return true;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct PreviousCopy;
+
+// --- Download Cache ---
+// Finished downloads, kept so the next job for the same links doesn't
+// fetch them again. Entries are found by link (normalized, one or more per
+// job), or by any other key the caller puts in CacheSource::url for links
+// that change every time (normalize_url leaves non-URLs as they are). They
+// remember the validators the servers sent with them. Before an
+// entry is used every server is asked whether it is still current, with a
+// conditional request that costs a round trip instead of the file.
+//
+// The files themselves are stored once per content, named by SHA-256, so
+// two links to the same bytes share one copy. They go into place as a
+// reflink where the file system can, a hard link where it can't, and a copy
+// across file systems. Stored files are read-only: with a hard link, the
+// output is the cached file. Storing always makes a copy of its own (a
+// reflink where it can), so the output that was stored stays the caller's.
+//
+// On disk: <dir>/objects/<sha256> and <dir>/index, least recently used
+// entry first. Past max_bytes the least recently used entries go.
+
+struct CacheSource {
+    std::string url;           // or the caller's key, for previous()
+    std::string etag;          // validators of the version that was downloaded
+    std::string last_modified;
+};
+
+class DownloadCache {
+public:
+    DownloadCache(std::string dir, long long max_bytes);
+    DownloadCache(const DownloadCache&) = delete;
+    DownloadCache& operator=(const DownloadCache&) = delete;
+
+    // Puts the cached download of `urls` at `output` if there is one and
+    // every server says it is still current. Returns its size, or -1 (with
+    // nothing written) if it can't; entries the servers say are stale go.
+    long long fetch(const std::vector<std::string>& urls, const std::string& output);
+
+    // For a download that asks the server itself (DownloadOptions::previous):
+    // the cached copy filed under `url` (a link or the caller's key, see
+    // CacheSource), linked to `path` so eviction can't take it
+    // away meanwhile, with the validators it came with. Null when there is
+    // none. used() then counts a hit if the server said the copy was still
+    // current and a miss otherwise; a stale entry is replaced by the store()
+    // of what was downloaded instead.
+    std::shared_ptr<PreviousCopy> previous(const std::string& url, const std::string& path);
+    void used(const std::string& url, bool current);
+    bool has(const std::string& url) const;
+
+    // Adds the finished download at `output` of `sources`, one per link in
+    // the order fetch() gets them. Skipped when a source has no validators
+    // to check it by later, or the file alone is bigger than the cache.
+    bool store(const std::vector<CacheSource>& sources, const std::string& output);
+
+    long long size() const;
+
+private:
+    struct Entry {
+        std::vector<CacheSource> sources;
+        std::string hash;
+        std::list<std::string>::iterator position; // in lru_
+    };
+    struct Object {
+        long long size = 0;
+        int entries = 0; // that point at it
+    };
+
+    std::string object_path(const std::string& hash) const { return dir_ + "/objects/" + hash; }
+    void load();
+    void save() const;
+    void drop(const std::string& key);
+    void evict();
+
+    std::string dir_;
+    long long max_bytes_;
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, Entry> entries_; // by key (the normalized links)
+    std::unordered_map<std::string, Object> objects_; // by hash
+    std::list<std::string> lru_;                       // keys, least recently used first
+    long long bytes_ = 0;                              // in objects_
+    std::atomic<unsigned> next_temp_{0};               // names objects being filed
+};
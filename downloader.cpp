@@ -0,0 +1,1522 @@
+#include "downloader.h"
+#include "buffer_pool.h"
+#include "dns_cache.h"
+#include "metrics.h"
+#include "piece_manifest.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cctype>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <curl/curl.h>
+#include <fcntl.h>
+#include <fstream>
+#include <functional>
+#include <linux/fs.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <strings.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+const char* engine_mode_name(EngineMode mode) {
+    switch (mode) {
+        case EngineMode::Single: return "single";
+        case EngineMode::Segmented: return "segmented";
+        case EngineMode::Multiplexed: return "multiplexed";
+        case EngineMode::Auto: return "auto";
+    }
+    return "unknown";
+}
+
+bool parse_engine_mode(const std::string& name, EngineMode& mode) {
+    if (name == "single") mode = EngineMode::Single;
+    else if (name == "segmented") mode = EngineMode::Segmented;
+    else if (name == "multiplexed") mode = EngineMode::Multiplexed;
+    else if (name == "auto") mode = EngineMode::Auto;
+    else return false;
+    return true;
+}
+
+static void init_curl_once() {
+    static std::once_flag once;
+    std::call_once(once, []{ curl_global_init(CURL_GLOBAL_DEFAULT); });
+}
+
+// --- 1. Connection Pool ---
+// Finished handles go back into a per-host pool instead of being cleaned up.
+// A curl handle keeps its connections open after a transfer, so the next
+// request to that host (from this job or the next one) skips the TCP and
+// TLS handshakes. With thousands of small files that is most of the cost.
+//
+// libcurl can't share one connection cache between threads, so each pooled
+// handle keeps its own; the DNS and TLS session caches are shared.
+constexpr size_t POOL_HANDLES_PER_HOST = 16;
+
+static std::mutex pool_mutex;
+// Never destroyed, like the handles in it: they live until the process exits
+static std::map<std::string, std::vector<CURL*>>& idle_handles = *new std::map<std::string, std::vector<CURL*>>;
+static std::mutex share_locks[CURL_LOCK_DATA_LAST];
+
+static void share_lock(CURL*, curl_lock_data data, curl_lock_access, void*) { share_locks[data].lock(); }
+static void share_unlock(CURL*, curl_lock_data data, void*) { share_locks[data].unlock(); }
+
+static CURLSH* engine_share() {
+    static CURLSH* share = [] {
+        init_curl_once();
+        CURLSH* s = curl_share_init();
+        curl_share_setopt(s, CURLSHOPT_LOCKFUNC, share_lock);
+        curl_share_setopt(s, CURLSHOPT_UNLOCKFUNC, share_unlock);
+        curl_share_setopt(s, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(s, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+        return s;
+    }();
+    return share;
+}
+
+// A handle with default options, most likely with a live connection to `host`
+static CURL* borrow_handle(const std::string& host) {
+    CURL* curl = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        std::vector<CURL*>& idle = idle_handles[host];
+        if (!idle.empty()) {
+            curl = idle.back();
+            idle.pop_back();
+        }
+    }
+    // reset() drops the options but keeps the open connections
+    if (curl) curl_easy_reset(curl);
+    else curl = curl_easy_init();
+    if (curl) curl_easy_setopt(curl, CURLOPT_SHARE, engine_share());
+    return curl;
+}
+
+static void return_handle(const std::string& host, CURL* curl) {
+    if (!curl) return;
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        std::vector<CURL*>& idle = idle_handles[host];
+        if (idle.size() < POOL_HANDLES_PER_HOST) {
+            idle.push_back(curl);
+            return;
+        }
+    }
+    curl_easy_cleanup(curl);
+}
+
+// Sends the handle to one address from our DNS cache instead of letting curl
+// resolve the host. TLS still checks the certificate against the host name.
+// The list has to stay alive until the transfer is over.
+static curl_slist* connect_to_address(CURL* curl, const std::string& host, const std::string& address) {
+    std::string target = address.find(':') != std::string::npos ? "[" + address + "]" : address;
+    curl_slist* list = curl_slist_append(nullptr, (host + "::" + target + ":").c_str());
+    curl_easy_setopt(curl, CURLOPT_CONNECT_TO, list);
+    return list;
+}
+
+// One request against the host's first cached address. If that address
+// can't be reached it gets marked and the request goes once more, to the
+// next address or, with none left, wherever curl resolves the host to.
+// `before_retry` throws away what the first try left behind.
+static CURLcode perform_with_dns_cache(CURL* curl, const std::string& host, const std::function<void()>& before_retry) {
+    std::vector<std::string> addresses = dns_lookup(host);
+    curl_slist* pin = addresses.empty() ? nullptr : connect_to_address(curl, host, addresses[0]);
+    CURLcode code = curl_easy_perform(curl);
+    if (pin && code == CURLE_COULDNT_CONNECT) {
+        dns_mark_unreachable(host, addresses[0]);
+        curl_easy_setopt(curl, CURLOPT_CONNECT_TO, nullptr);
+        curl_slist_free_all(pin);
+        addresses = dns_lookup(host);
+        pin = addresses.empty() ? nullptr : connect_to_address(curl, host, addresses[0]);
+        before_retry();
+        code = curl_easy_perform(curl);
+    }
+    curl_easy_setopt(curl, CURLOPT_CONNECT_TO, nullptr);
+    curl_slist_free_all(pin);
+    return code;
+}
+
+// --- 2. The Writer Stage ---
+// Download threads never touch the disk. They fill pooled buffers and queue
+// them here; one writer thread drains the queue and hands the buffers back.
+// The queue is an intrusive list through RecvBuffer::next, so pushing never allocates.
+class WriteQueue {
+public:
+    void start(uint32_t trace_job) {
+        closed_ = false;
+        trace_job_ = trace_job;
+        thread_ = std::thread(&WriteQueue::writer_loop, this);
+    }
+
+    void push(RecvBuffer* buffer) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (tail_) tail_->next = buffer;
+            else head_ = buffer;
+            tail_ = buffer;
+        }
+        cv_.notify_one();
+    }
+
+    // Drains whatever is still queued, then stops the writer thread
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+        }
+        cv_.notify_all();
+        if (thread_.joinable()) thread_.join();
+    }
+
+private:
+    void writer_loop() {
+        while (true) {
+            RecvBuffer* batch;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this]{ return head_ != nullptr || closed_; });
+                if (!head_) return; // closed and fully drained
+
+                batch = head_;
+                head_ = tail_ = nullptr;
+            }
+
+            // Buffers from the same thread stay in order, so each part file is sequential
+            while (batch) {
+                RecvBuffer* next = batch->next;
+                long long started = trace_now();
+                ((std::ofstream*)batch->target)->write(batch->data, batch->len);
+                long long took = trace_now() - started;
+                metrics_observe_write_latency(took / 1e6);
+                trace_complete(trace_job_, TRACE_TRACK_WRITER, "write", started, took, batch->len);
+                metrics_add(MetricCounter::BytesWritten, batch->len);
+                BufferPool::release(batch);
+                batch = next;
+            }
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    RecvBuffer* head_ = nullptr;
+    RecvBuffer* tail_ = nullptr;
+    bool closed_ = false;
+    uint32_t trace_job_ = 0;
+    std::thread thread_;
+};
+
+// --- 3. The Write Function ---
+struct SegmentTransfer {
+    SegmentTransfer(Download* download, Segment* segment, std::ofstream* stream, WriteQueue* queue, BufferCache* cache)
+        : download(download), segment(segment), stream(stream), queue(queue), cache(cache) {}
+
+    Download* download;
+    Segment* segment;
+    std::ofstream* stream;
+    WriteQueue* queue;
+    BufferCache* cache;
+    RecvBuffer* buffer = nullptr; // partly filled buffer, not queued yet
+    CURL* curl = nullptr;
+    curl_slist* headers = nullptr;
+    curl_slist* connect_to = nullptr; // pins the segment to `address`
+    std::string host;
+    std::string address; // remote end, "" = wherever curl resolves the host to
+    std::string source;  // local end (CURLOPT_INTERFACE), "" = the OS picks
+    int track = 0;
+    long long started = 0;         // trace clock, when the segment was picked up
+    long long attempt_started = 0; // trace clock, when the current request went out
+    long long done_before = 0;     // segment->done when the current request went out
+
+    // Reset before every attempt
+    long long from = 0;        // where this attempt's Range starts
+    long long skip = 0;        // bytes to throw away first (the server ignored our Range)
+    bool checked = false;      // have we looked at the response yet?
+    std::string etag;          // from the response headers
+    long long range_start = -1; // from Content-Range, -1 when there is none
+    long long range_total = -1;
+
+    void begin_attempt(long long start) {
+        from = start;
+        skip = 0;
+        checked = false;
+        etag.clear();
+        range_start = range_total = -1;
+    }
+
+    void flush() {
+        if (buffer) queue->push(buffer);
+        buffer = nullptr;
+    }
+
+    bool check_response();
+    static int check_abort(void* userdata, curl_off_t, curl_off_t, curl_off_t, curl_off_t);
+};
+
+static bool starts_with_nocase(const std::string& line, const char* prefix) {
+    size_t n = strlen(prefix);
+    return line.size() >= n && strncasecmp(line.c_str(), prefix, n) == 0;
+}
+
+static std::string header_value(const std::string& line) {
+    size_t colon = line.find(':');
+    size_t begin = line.find_first_not_of(" \t", colon + 1);
+    size_t end = line.find_last_not_of(" \t\r\n");
+    if (colon == std::string::npos || begin == std::string::npos || end < begin) return "";
+    return line.substr(begin, end - begin + 1);
+}
+
+size_t read_header(char* buffer, size_t size, size_t nitems, void* userdata) {
+    size_t len = size * nitems;
+    SegmentTransfer* data = (SegmentTransfer*)userdata;
+    std::string line(buffer, len);
+
+    if (starts_with_nocase(line, "HTTP/")) {
+        // A new response (after a redirect, say). Forget the last one's headers.
+        data->etag.clear();
+        data->range_start = data->range_total = -1;
+    } else if (starts_with_nocase(line, "ETag:")) {
+        data->etag = header_value(line);
+    } else if (starts_with_nocase(line, "Content-Range:")) {
+        long long first, last, total;
+        if (sscanf(header_value(line).c_str(), "bytes %lld-%lld/%lld", &first, &last, &total) == 3) {
+            data->range_start = first;
+            data->range_total = total;
+        }
+    }
+    return len;
+}
+
+// Looks at the status and headers before the first body byte is kept.
+// Returning false aborts the transfer; the retry loop decides what happens next.
+bool SegmentTransfer::check_response() {
+    long code = 0;
+    curl_off_t length = -1;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+    curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+
+    const std::string& expected = download->etag_;
+    long long total_size = download->total_size();
+    bool changed = !expected.empty() && !etag.empty() && etag != expected;
+
+    if (code == 206) {
+        if (changed || (range_total >= 0 && range_total != total_size)) {
+            download->restart_ = true;
+            return false;
+        }
+        // Not the bytes we asked for. Don't trust it, just ask again.
+        return range_start == from;
+    }
+
+    if (code == 200) {
+        // Either If-Range told the server our copy is stale, or it doesn't do
+        // ranges at all. Only the second one lets us keep going.
+        if (changed || (length >= 0 && length != total_size)) {
+            download->restart_ = true;
+            return false;
+        }
+        skip = from;
+        return true;
+    }
+
+    return false;
+}
+
+// Stops every segment as soon as one of them finds out the file has changed,
+// or someone pauses or cancels the download. Aborting mid-body means curl
+// closes the connection instead of keeping it, so it is free straight away.
+int SegmentTransfer::check_abort(void* userdata, curl_off_t, curl_off_t, curl_off_t, curl_off_t) {
+    SegmentTransfer* data = (SegmentTransfer*)userdata;
+    return data->download->restart_.load(std::memory_order_relaxed) ||
+           data->download->stop_.load(std::memory_order_relaxed) != Download::StopRequest::None;
+}
+
+size_t write_data(void* ptr, size_t size, size_t nmemb, void* userdata) {
+    size_t written = size * nmemb;
+    SegmentTransfer* data = (SegmentTransfer*)userdata;
+    const char* src = (const char*)ptr;
+    size_t left = written;
+
+    if (!data->checked) {
+        if (!data->check_response()) return 0;
+        data->checked = true;
+    }
+
+    // The server sent the whole file, drop what comes before our range
+    if (data->skip > 0) {
+        size_t n = (size_t)std::min<long long>(data->skip, left);
+        data->skip -= n;
+        src += n;
+        left -= n;
+        if (left == 0) return written;
+    }
+
+    // Never keep more than the segment needs. Telling libcurl we took less
+    // than it gave us ends the transfer, which is what we want at that point.
+    long long remaining = data->segment->length() - data->segment->done.load(std::memory_order_relaxed);
+    bool overflow = (long long)left > remaining;
+    if (overflow) left = (size_t)remaining;
+    size_t kept = left;
+
+    if (kept > 0) data->download->note_first_byte();
+
+    // Copy into our pooled buffer and ship it to the writer once it is full
+    while (left > 0) {
+        if (!data->buffer) {
+            data->buffer = data->cache->acquire();
+            data->buffer->target = data->stream;
+        }
+        size_t n = std::min(left, RECV_BUFFER_SIZE - data->buffer->len);
+        memcpy(data->buffer->data + data->buffer->len, src, n);
+        data->buffer->len += n;
+        src += n;
+        left -= n;
+
+        if (data->buffer->len == RECV_BUFFER_SIZE) data->flush();
+    }
+
+    // Only this thread writes its segment, the dashboard just reads it
+    data->segment->done.fetch_add(kept, std::memory_order_relaxed);
+    metrics_add(MetricCounter::BytesReceived, kept);
+    return overflow ? 0 : written;
+}
+
+// --- 4. Worker Thread ---
+Download::Download(DownloadOptions options)
+    : options_(std::move(options)), writer_(std::make_unique<WriteQueue>()) {
+    init_curl_once();
+    if (!options_.trace_path.empty()) trace_job_ = trace_new_job();
+}
+
+Download::~Download() = default;
+
+void Download::pause() {
+    StopRequest expected = StopRequest::None;
+    stop_.compare_exchange_strong(expected, StopRequest::Pause); // a cancel stays a cancel
+}
+
+void Download::resume() {
+    StopRequest expected = StopRequest::Pause;
+    stop_.compare_exchange_strong(expected, StopRequest::None);
+}
+
+void Download::cancel() { stop_ = StopRequest::Cancel; }
+
+void Download::note_first_byte() {
+    if (got_first_byte_.load(std::memory_order_relaxed)) return;
+    auto now = std::chrono::steady_clock::now();
+    if (!got_first_byte_.exchange(true)) first_byte_at_ = now;
+}
+
+std::string Download::part_name(int id) const {
+    return options_.output + ".part_" + std::to_string(id);
+}
+
+long long Download::downloaded() const {
+    std::lock_guard<std::mutex> lock(segments_mutex_);
+    long long total = 0;
+    for (const Segment& segment : segments_) total += segment.done.load(std::memory_order_relaxed);
+    return total;
+}
+
+std::vector<SegmentProgress> Download::progress() const {
+    std::lock_guard<std::mutex> lock(segments_mutex_);
+    std::vector<SegmentProgress> result;
+    for (const Segment& segment : segments_) {
+        result.push_back({segment.id, segment.length(), segment.done.load(std::memory_order_relaxed)});
+    }
+    return result;
+}
+
+static void record_throughput(CURL* curl, const std::string& host, long long bytes) {
+    curl_off_t micros = 0;
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &micros);
+    if (bytes > 0 && micros > 0) metrics_observe_host_throughput(host, bytes * 1e6 / micros);
+}
+
+// Splits one request into the phases libcurl timed for us, so a slow segment
+// shows whether it was DNS, the handshakes, the server or the transfer itself.
+static void trace_attempt(uint32_t job, int track, CURL* curl, long long started, long long bytes) {
+    if (job == 0) return;
+    curl_off_t lookup = 0, connect = 0, tls = 0, pretransfer = 0, first_byte = 0, total = 0;
+    curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &lookup);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+    curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &first_byte);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+
+    // A reused connection reports 0 for the steps it skipped
+    if (lookup > 0) trace_complete(job, track, "resolve", started, lookup);
+    if (connect > lookup) trace_complete(job, track, "connect", started + lookup, connect - lookup);
+    if (tls > connect) trace_complete(job, track, "tls", started + connect, tls - connect);
+    if (first_byte > pretransfer) trace_complete(job, track, "first byte", started + pretransfer, first_byte - pretransfer);
+    if (total > first_byte) trace_complete(job, track, "transfer", started + first_byte, total - first_byte, bytes);
+}
+
+// --- 5. Alt-Svc Cache ---
+// Servers announce HTTP/3 in an Alt-Svc header on a normal TCP response, so
+// the first job against a host always goes over TCP and the ones after it
+// can use QUIC. We keep those announcements per host for as long as the
+// server said (ma=), and park a host for a while when QUIC failed on it.
+constexpr int ALT_SVC_DEFAULT_MAX_AGE = 86400;  // seconds, RFC 7838's default
+constexpr int ALT_SVC_BROKEN_SECONDS = 300;     // how long a failed host stays on TCP
+
+struct AltSvcEntry {
+    long port = 0; // where h3 is offered; only the URL's own port is used
+    std::chrono::steady_clock::time_point expires;
+    std::chrono::steady_clock::time_point broken_until;
+};
+
+static std::mutex alt_svc_mutex;
+static std::map<std::string, AltSvcEntry> alt_svc_cache;
+
+bool http3_supported() {
+    init_curl_once();
+    return (curl_version_info(CURLVERSION_NOW)->features & CURL_VERSION_HTTP3) != 0;
+}
+
+static long url_port(const std::string& url) {
+    long port = 0;
+    CURLU* parsed = curl_url();
+    char* part = nullptr;
+    if (curl_url_set(parsed, CURLUPART_URL, url.c_str(), 0) == CURLUE_OK &&
+        curl_url_get(parsed, CURLUPART_PORT, &part, CURLU_DEFAULT_PORT) == CURLUE_OK) {
+        port = atol(part);
+        curl_free(part);
+    }
+    curl_url_cleanup(parsed);
+    return port;
+}
+
+// Alt-Svc: h3=":443"; ma=86400, h3-29=":443"; ma=86400, h2=":443"
+static void alt_svc_update(const std::string& host, const std::string& header) {
+    if (header.empty()) return;
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(alt_svc_mutex);
+    if (header == "clear") {
+        alt_svc_cache.erase(host);
+        return;
+    }
+
+    size_t pos = 0;
+    while (pos < header.size()) {
+        size_t end = header.find(',', pos);
+        if (end == std::string::npos) end = header.size();
+        std::string entry = header.substr(pos, end - pos);
+        pos = end + 1;
+
+        size_t start = entry.find_first_not_of(' ');
+        if (start == std::string::npos || entry.compare(start, 3, "h3=") != 0) continue;
+        // We only switch protocol, never host, so "other.host:443" is skipped
+        size_t colon = entry.find(':', start);
+        size_t quote = entry.find('"', start + 4);
+        if (colon == std::string::npos || quote == std::string::npos || colon != start + 4) continue;
+
+        long max_age = ALT_SVC_DEFAULT_MAX_AGE;
+        size_t ma = entry.find("ma=");
+        if (ma != std::string::npos) max_age = atol(entry.c_str() + ma + 3);
+
+        AltSvcEntry& cached = alt_svc_cache[host];
+        cached.port = atol(entry.c_str() + colon + 1);
+        cached.expires = now + std::chrono::seconds(max_age);
+        return;
+    }
+}
+
+static bool alt_svc_has_http3(const std::string& host, long port) {
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(alt_svc_mutex);
+    auto it = alt_svc_cache.find(host);
+    if (it == alt_svc_cache.end()) return false;
+    const AltSvcEntry& entry = it->second;
+    return entry.port == port && entry.expires > now && entry.broken_until <= now;
+}
+
+static void alt_svc_forget(const std::string& host) {
+    std::lock_guard<std::mutex> lock(alt_svc_mutex);
+    auto it = alt_svc_cache.find(host);
+    if (it != alt_svc_cache.end()) {
+        it->second.broken_until = std::chrono::steady_clock::now() + std::chrono::seconds(ALT_SVC_BROKEN_SECONDS);
+    }
+}
+
+// --- 6. Path Selection ---
+// A segment's path has two ends we get to choose: the remote address (a CDN
+// host name usually stands for several edges) and the local source (hosts
+// with several uplinks). Neither is ever equally fast everywhere. Every
+// finished request teaches us the per-connection speed of both ends, and new
+// segments go where they can expect the most: that speed shared by the
+// segments already headed there. Choices we haven't measured (or not for a
+// while) get the benefit of the doubt, so a slow one gets another chance now
+// and then.
+constexpr int PATH_STATS_MAX_AGE = 60;           // seconds before a measurement counts as unknown
+constexpr long long PATH_MIN_SAMPLE = 64 * 1024; // smaller transfers are mostly handshake
+const std::string LOCAL_SOURCES = "";            // scope for source addresses: they serve every host
+
+struct PathStats {
+    double bytes_per_second = 0; // smoothed, per connection
+    std::chrono::steady_clock::time_point updated;
+};
+
+static std::mutex path_mutex;
+static std::map<std::string, PathStats> path_stats; // "scope choice", scope being the host for edges
+
+static double record_path_throughput(const std::string& scope, const std::string& choice, double rate) {
+    std::lock_guard<std::mutex> lock(path_mutex);
+    PathStats& stats = path_stats[scope + " " + choice];
+    auto now = std::chrono::steady_clock::now();
+    bool stale = now - stats.updated > std::chrono::seconds(PATH_STATS_MAX_AGE);
+    stats.bytes_per_second = stale ? rate : 0.7 * stats.bytes_per_second + 0.3 * rate;
+    stats.updated = now;
+    return stats.bytes_per_second;
+}
+
+static void record_segment_path(const SegmentTransfer& data, long long bytes) {
+    curl_off_t micros = 0;
+    curl_easy_getinfo(data.curl, CURLINFO_TOTAL_TIME_T, &micros);
+    if (bytes < PATH_MIN_SAMPLE || micros <= 0) return;
+
+    double rate = bytes * 1e6 / micros;
+    if (!data.address.empty()) {
+        metrics_set_edge_throughput(data.host, data.address, record_path_throughput(data.host, data.address, rate));
+    }
+    if (!data.source.empty()) {
+        metrics_set_source_throughput(data.source, record_path_throughput(LOCAL_SOURCES, data.source, rate));
+    }
+}
+
+// What one more connection through each choice can expect, per connection
+static std::vector<double> expected_speeds(const std::string& scope, const std::vector<std::string>& choices) {
+    std::vector<double> speeds(choices.size(), 0);
+    double best = 0;
+    {
+        std::lock_guard<std::mutex> lock(path_mutex);
+        auto now = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < choices.size(); i++) {
+            auto it = path_stats.find(scope + " " + choices[i]);
+            if (it == path_stats.end() || now - it->second.updated > std::chrono::seconds(PATH_STATS_MAX_AGE)) continue;
+            speeds[i] = it->second.bytes_per_second;
+            best = std::max(best, speeds[i]);
+        }
+    }
+    for (double& speed : speeds) {
+        if (speed == 0) speed = best > 0 ? best : 1; // unknown: assume it's as good as the best one
+    }
+    return speeds;
+}
+
+// One choice per segment. Each goes to the one with the best speed left once
+// the segments already sent there are counted; ties keep the given order, so
+// with nothing measured yet the segments simply take turns.
+static std::vector<std::string> assign_by_speed(const std::string& scope, const std::vector<std::string>& choices,
+                                                size_t segments) {
+    std::vector<std::string> assigned;
+    if (choices.empty()) return assigned;
+    std::vector<double> speeds = expected_speeds(scope, choices);
+    std::vector<int> load(choices.size(), 0);
+    for (size_t s = 0; s < segments; s++) {
+        size_t best = 0;
+        for (size_t i = 1; i < choices.size(); i++) {
+            if (speeds[i] / (1 + load[i]) > speeds[best] / (1 + load[best])) best = i;
+        }
+        load[best]++;
+        assigned.push_back(choices[best]);
+    }
+    return assigned;
+}
+
+// --- 7. Segment Transfers ---
+// The steps below are shared by both ways of driving transfers: one blocking
+// thread per segment, or every segment as a stream on one multi handle.
+static int backoff_ms(int retries) {
+    return std::min(100 << std::min(retries, 5), 2000);
+}
+
+bool Download::setup_transfer(SegmentTransfer& data) {
+    data.host = url_host(options_.url);
+    data.curl = borrow_handle(data.host);
+    if (!data.curl) return false;
+    CURL* curl = data.curl;
+
+    // If-Range makes a server that has a newer version send it whole (200)
+    // instead of handing us a slice of it. Weak ETags aren't allowed there.
+    if (!etag_.empty()) data.headers = curl_slist_append(data.headers, ("If-Range: " + etag_).c_str());
+
+    curl_easy_setopt(curl, CURLOPT_URL, options_.url.c_str());
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, &data);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_data);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &data);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, read_header);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &data);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, &SegmentTransfer::check_abort);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, &data);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, data.headers);
+    // HTTP_VERSION_3 still falls back to TCP by itself when the QUIC handshake fails
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, use_http3_ ? (long)CURL_HTTP_VERSION_3 : (long)CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    // A connection that goes quiet for 30s is as good as dead
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 30L);
+
+    // Pinned to an edge picked by fetch_segments: spreads the load, and no
+    // DNS lookup per connection
+    if ((size_t)data.segment->id < segment_edges_.size()) {
+        data.address = segment_edges_[data.segment->id];
+        data.connect_to = connect_to_address(curl, data.host, data.address);
+    }
+    // The same for our end: which uplink (interface or source IP) to go out on
+    if ((size_t)data.segment->id < segment_sources_.size()) {
+        data.source = segment_sources_[data.segment->id];
+        curl_easy_setopt(curl, CURLOPT_INTERFACE, data.source.c_str());
+    }
+
+    data.track = TRACE_TRACK_SEGMENT + data.segment->id;
+    data.started = trace_now();
+    metrics_add(MetricCounter::SegmentsStarted);
+    return true;
+}
+
+// Points the handle at whatever the segment still needs. False when there is nothing left to ask for.
+bool Download::start_attempt(SegmentTransfer& data) {
+    Segment& segment = *data.segment;
+    if (restart_ || stop_ != StopRequest::None) return false;
+
+    // Pick up where the last attempt stopped; the part file already has the rest
+    long long from = segment.start + segment.done.load();
+    if (from > segment.end) return false;
+
+    std::string range = std::to_string(from) + "-" + std::to_string(segment.end);
+    curl_easy_setopt(data.curl, CURLOPT_RANGE, range.c_str());
+    data.begin_attempt(from);
+    data.done_before = segment.done.load();
+    data.attempt_started = trace_now();
+    metrics_gauge_add(MetricGauge::ActiveConnections, 1);
+    return true;
+}
+
+// Bookkeeping once a request is over. True if the segment should try again.
+bool Download::end_attempt(SegmentTransfer& data, int code) {
+    Segment& segment = *data.segment;
+    long long got = segment.done.load() - data.done_before;
+    metrics_gauge_add(MetricGauge::ActiveConnections, -1);
+    record_throughput(data.curl, data.host, got);
+    record_segment_path(data, got);
+    trace_attempt(trace_job_, data.track, data.curl, data.attempt_started, got);
+
+    long version = 0;
+    curl_easy_getinfo(data.curl, CURLINFO_HTTP_VERSION, &version);
+    if (version == CURL_HTTP_VERSION_3) got_http3_ = true;
+    if (use_http3_ && (code == CURLE_QUIC_CONNECT_ERROR || code == CURLE_HTTP3)) {
+        // QUIC broke down mid-transfer (or a middlebox eats UDP). Finish this
+        // segment over TCP and leave HTTP/3 alone for this host for a while.
+        alt_svc_forget(data.host);
+        curl_easy_setopt(data.curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+    }
+    if (code == CURLE_COULDNT_CONNECT && data.connect_to) {
+        // That address is down. Move on to another one, or let curl pick
+        // when there are none left.
+        dns_mark_unreachable(data.host, data.address);
+        curl_easy_setopt(data.curl, CURLOPT_CONNECT_TO, nullptr);
+        curl_slist_free_all(data.connect_to);
+        data.connect_to = nullptr;
+        std::vector<std::string> addresses = assign_by_speed(data.host, dns_lookup(data.host), 1);
+        if (!addresses.empty()) {
+            data.address = addresses[0];
+            data.connect_to = connect_to_address(data.curl, data.host, data.address);
+        }
+    }
+
+    // Complete counts, even when we cut the transfer short ourselves
+    if (segment.done.load() >= segment.length()) return false;
+    if (restart_ || stop_ != StopRequest::None || segment.retries >= options_.max_retries) return false;
+
+    segment.retries++;
+    metrics_add(MetricCounter::Retries);
+    trace_instant(trace_job_, data.track, "retry", segment.retries);
+    return true;
+}
+
+void Download::finish_transfer(SegmentTransfer& data) {
+    data.flush(); // whatever is left over
+    trace_complete(trace_job_, data.track, "segment", data.started, trace_now() - data.started,
+                   data.segment->done.load());
+    if (data.curl) curl_easy_setopt(data.curl, CURLOPT_CONNECT_TO, nullptr);
+    curl_slist_free_all(data.headers);
+    curl_slist_free_all(data.connect_to);
+    return_handle(data.host, data.curl);
+    data.headers = nullptr;
+    data.connect_to = nullptr;
+    data.curl = nullptr;
+}
+
+// One thread, one connection, one segment
+void Download::download_segment(Segment& segment) {
+    ScopedBufferCache cache;
+    SegmentTransfer data(this, &segment, &parts_[segment.id], writer_.get(), cache.get());
+    if (!setup_transfer(data)) return;
+
+    while (start_attempt(data)) {
+        CURLcode code = curl_easy_perform(data.curl);
+        if (!end_attempt(data, code)) break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(backoff_ms(segment.retries)));
+    }
+    finish_transfer(data);
+}
+
+// Every segment as its own request on one multi handle. Over HTTP/2 they
+// become streams on a few shared connections instead of one TCP connection
+// (and handshake) each. Runs entirely on the calling thread.
+void Download::download_multiplexed(bool http2) {
+    ScopedBufferCache cache;
+    CURLM* multi = curl_multi_init();
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, (long)CURLPIPE_MULTIPLEX);
+    // HTTP/1.1 can't share, so there every segment still needs its own
+    // connection; they are just all driven from this one thread.
+    long connections = http2 ? std::max(1, options_.multiplex_connections) : (long)segments_.size();
+    curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, connections);
+
+    std::deque<SegmentTransfer> transfers; // a deque so the addresses handed to libcurl stay put
+    int active = 0;
+    for (Segment& segment : segments_) {
+        SegmentTransfer& data = transfers.emplace_back(this, &segment, &parts_[segment.id], writer_.get(), cache.get());
+        if (!setup_transfer(data)) continue;
+        // Wait for the shared connection rather than opening another one next to it
+        if (http2) curl_easy_setopt(data.curl, CURLOPT_PIPEWAIT, 1L);
+        if (start_attempt(data)) {
+            curl_multi_add_handle(multi, data.curl);
+            active++;
+        }
+    }
+
+    // Retries sit here until their backoff runs out
+    std::vector<std::pair<std::chrono::steady_clock::time_point, SegmentTransfer*>> waiting;
+
+    while (active > 0 || !waiting.empty()) {
+        int running = 0;
+        curl_multi_perform(multi, &running);
+
+        CURLMsg* msg;
+        int left;
+        while ((msg = curl_multi_info_read(multi, &left))) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            SegmentTransfer* data = nullptr;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&data);
+            curl_multi_remove_handle(multi, msg->easy_handle);
+            active--;
+            if (end_attempt(*data, msg->data.result)) {
+                auto due = std::chrono::steady_clock::now() + std::chrono::milliseconds(backoff_ms(data->segment->retries));
+                waiting.push_back({due, data});
+            }
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < waiting.size();) {
+            if (waiting[i].first > now) {
+                i++;
+                continue;
+            }
+            SegmentTransfer* data = waiting[i].second;
+            waiting.erase(waiting.begin() + i);
+            if (start_attempt(*data)) {
+                curl_multi_add_handle(multi, data->curl);
+                active++;
+            }
+        }
+
+        if (active > 0 || !waiting.empty()) curl_multi_poll(multi, nullptr, 0, 50, nullptr);
+    }
+
+    for (SegmentTransfer& data : transfers) finish_transfer(data);
+    curl_multi_cleanup(multi);
+}
+
+// Splits the file into segments and downloads them into the part files.
+// When resuming, the segments (and what they have) are the ones a pause left,
+// and the part files are appended to. True when every segment got all of its bytes.
+bool Download::fetch_segments(const RemoteInfo& info, EngineMode mode, bool resuming, DownloadResult& result) {
+    long long size = info.size;
+    int num_segments = mode == EngineMode::Single ? 1 : std::max(1, options_.num_threads);
+    if (size < num_segments || !info.accepts_ranges) num_segments = 1;
+
+    if (resuming) {
+        num_segments = (int)segments_.size();
+    } else {
+        std::lock_guard<std::mutex> lock(segments_mutex_);
+        segments_.clear();
+        long long chunk_size = size / num_segments;
+        for (int i = 0; i < num_segments; i++) {
+            Segment& segment = segments_.emplace_back();
+            segment.id = i;
+            segment.start = i * chunk_size;
+            segment.end = (i == num_segments - 1) ? size - 1 : (segment.start + chunk_size - 1);
+        }
+        total_size_ = size;
+    }
+
+    segment_edges_ = assign_by_speed(url_host(options_.url), addresses_, num_segments);
+    segment_sources_ = assign_by_speed(LOCAL_SOURCES, options_.interfaces, num_segments);
+
+    parts_.clear();
+    parts_.resize(num_segments);
+    for (int i = 0; i < num_segments; i++) {
+        parts_[i].open(part_name(i), std::ios::binary | (resuming ? std::ios::app : std::ios::trunc));
+    }
+
+    // Whatever the probe already fetched is not asked for again
+    for (Segment& segment : segments_) {
+        long long have = std::min<long long>(first_bytes_.size(), segment.end + 1) - segment.start;
+        if (resuming || have <= 0) continue;
+        parts_[segment.id].write(first_bytes_.data() + segment.start, have);
+        segment.done = have;
+        metrics_add(MetricCounter::BytesWritten, have);
+    }
+    writer_->start(trace_job_);
+
+    if (mode == EngineMode::Multiplexed) {
+        download_multiplexed(info.http2);
+    } else if (segments_.size() == 1) {
+        download_segment(segments_.front()); // no point in a thread for one connection
+    } else {
+        std::vector<std::thread> workers;
+        for (Segment& segment : segments_) {
+            workers.push_back(std::thread(&Download::download_segment, this, std::ref(segment)));
+        }
+        for (auto& t : workers) t.join();
+    }
+
+    // Let the writer drain what is still queued before closing the part files
+    writer_->close();
+    for (auto& part : parts_) part.close();
+
+    bool complete = true;
+    for (const Segment& segment : segments_) {
+        result.retries += segment.retries;
+        if (segment.done.load() != segment.length()) complete = false;
+    }
+    return complete;
+}
+
+// The previous copy is an older version of the file. With the server's
+// piece manifest only the pieces whose hashes differ get fetched; the rest
+// are copied out of the old file into the part files, as done segments,
+// and fetch_segments() carries on from there like after a pause.
+constexpr size_t MANIFEST_LIMIT = 16 << 20; // a 1 MiB piece size covers 256 GiB in that
+
+static size_t read_manifest(char* ptr, size_t size, size_t nmemb, void* userdata) {
+    std::string* text = (std::string*)userdata;
+    size_t len = size * nmemb;
+    if (text->size() + len > MANIFEST_LIMIT) return 0;
+    text->append(ptr, len);
+    metrics_add(MetricCounter::BytesReceived, len);
+    return len;
+}
+
+static bool fetch_manifest(const std::string& url, PieceManifest& manifest) {
+    std::string host = url_host(url);
+    CURL* curl = borrow_handle(host);
+    if (!curl) return false;
+    std::string text;
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 30L);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, read_manifest);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &text);
+    CURLcode code = perform_with_dns_cache(curl, host, [&]{ text.clear(); });
+    return_handle(host, curl);
+    return code == CURLE_OK && parse_piece_manifest(text, manifest);
+}
+
+// False (with nothing planned) when there is no manifest or nothing in the old copy is worth keeping
+bool Download::plan_refresh(const RemoteInfo& info, int connections) {
+    const PreviousCopy& previous = *options_.previous;
+    PieceManifest manifest;
+    if (previous.manifest_url.empty() || !info.accepts_ranges) return false;
+    if (!fetch_manifest(previous.manifest_url, manifest) || manifest.size != info.size) return false;
+    std::vector<std::string> have = piece_hashes(previous.path, manifest.piece_size);
+
+    // Runs of pieces we have (reuse) or don't; they alternate
+    struct Run {
+        long long first, last;
+        bool reuse;
+    };
+    std::vector<Run> runs;
+    for (long long i = 0; i < (long long)manifest.hashes.size(); i++) {
+        bool reuse = i < (long long)have.size() && have[i] == manifest.hashes[i];
+        if (!runs.empty() && runs.back().reuse == reuse) runs.back().last = i;
+        else runs.push_back({i, i, reuse});
+    }
+    auto missing_runs = [&] { return std::count_if(runs.begin(), runs.end(), [](const Run& run) { return !run.reuse; }); };
+    // A connection per missing run; past `connections` of them, the shortest gaps get fetched too
+    while (missing_runs() > std::max(1, connections)) {
+        size_t gap = 0;
+        for (size_t i = 1; i + 1 < runs.size(); i++) {
+            if (runs[i].reuse && (gap == 0 || runs[i].last - runs[i].first < runs[gap].last - runs[gap].first)) gap = i;
+        }
+        runs[gap - 1].last = runs[gap + 1].last;
+        runs.erase(runs.begin() + gap, runs.begin() + gap + 2);
+    }
+    if (std::none_of(runs.begin(), runs.end(), [](const Run& run) { return run.reuse; })) return false;
+
+    int in = open(previous.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) return false;
+    bool ok = true;
+    std::lock_guard<std::mutex> lock(segments_mutex_);
+    segments_.clear();
+    for (const Run& run : runs) {
+        Segment& segment = segments_.emplace_back();
+        segment.id = (int)segments_.size() - 1;
+        segment.start = run.first * manifest.piece_size;
+        segment.end = std::min(info.size, (run.last + 1) * manifest.piece_size) - 1;
+        int out = open(part_name(segment.id).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        ok = ok && out >= 0;
+        if (run.reuse) {
+            loff_t from = segment.start;
+            long long left = segment.length();
+            while (ok && left > 0) {
+                ssize_t n = copy_file_range(in, &from, out, nullptr, left, 0);
+                ok = n > 0;
+                if (ok) left -= n;
+            }
+            segment.done = segment.length() - left;
+        } else if (ok && segment.start < (long long)first_bytes_.size()) {
+            // What the probe brought isn't asked for again
+            long long have = std::min<long long>(first_bytes_.size(), segment.end + 1) - segment.start;
+            ok = write(out, first_bytes_.data() + segment.start, have) == have;
+            segment.done = have;
+            metrics_add(MetricCounter::BytesWritten, have);
+        }
+        if (out >= 0) close(out);
+    }
+    close(in);
+    if (!ok) {
+        remove_parts();
+        segments_.clear();
+        return false;
+    }
+    total_size_ = info.size;
+    refresh_hashes_ = manifest.hashes;
+    refresh_piece_size_ = manifest.piece_size;
+    return true;
+}
+
+// --- 8. Mode Selection ---
+// Many connections win when each one is capped (per-connection shaping, long
+// fat pipes); one multiplexed connection wins when handshakes and slow start
+// dominate. Nothing tells us up front which host is which, so Auto measures:
+// it tries both, then keeps using the faster one and re-checks the other now
+// and then in case things changed.
+constexpr int MODE_RECHECK_EVERY = 10; // jobs per host
+
+struct HostModeStats {
+    double segmented = 0;   // smoothed bytes/s
+    double multiplexed = 0;
+    int jobs = 0;
+};
+
+static std::mutex mode_mutex;
+static std::map<std::string, HostModeStats> mode_stats;
+
+static EngineMode choose_mode(const std::string& host, bool http2) {
+    if (!http2) return EngineMode::Segmented; // HTTP/1.1 can't share a connection
+    std::lock_guard<std::mutex> lock(mode_mutex);
+    HostModeStats& stats = mode_stats[host];
+    stats.jobs++;
+    // One connection is the cheaper option, so it gets tried first
+    if (stats.multiplexed == 0) return EngineMode::Multiplexed;
+    if (stats.segmented == 0) return EngineMode::Segmented;
+
+    bool multiplexed_wins = stats.multiplexed >= stats.segmented;
+    if (stats.jobs % MODE_RECHECK_EVERY == 0) multiplexed_wins = !multiplexed_wins;
+    return multiplexed_wins ? EngineMode::Multiplexed : EngineMode::Segmented;
+}
+
+static void record_mode_throughput(const std::string& host, EngineMode mode, double bytes_per_second) {
+    std::lock_guard<std::mutex> lock(mode_mutex);
+    HostModeStats& stats = mode_stats[host];
+    double& average = mode == EngineMode::Multiplexed ? stats.multiplexed : stats.segmented;
+    average = average == 0 ? bytes_per_second : 0.7 * average + 0.3 * bytes_per_second;
+}
+
+// --- 9. Merge Function ---
+bool Download::write_whole_file() {
+    long long size = first_bytes_.size();
+    {
+        std::lock_guard<std::mutex> lock(segments_mutex_);
+        segments_.clear();
+        Segment& segment = segments_.emplace_back();
+        segment.end = size - 1;
+        segment.done = size;
+        total_size_ = size;
+    }
+    remove(options_.output.c_str()); // see merge_parts()
+    std::ofstream outfile(options_.output, std::ios::binary | std::ios::trunc);
+    outfile.write(first_bytes_.data(), size);
+    outfile.close();
+    metrics_add(MetricCounter::BytesWritten, size);
+    return outfile.good();
+}
+
+// The previous copy is still current: it goes into place as it is
+bool Download::keep_previous(const RemoteInfo& info, DownloadResult& result) {
+    const PreviousCopy& previous = *options_.previous;
+    struct stat file;
+    if (!clone_into_place(previous.path, options_.output) || stat(options_.output.c_str(), &file) != 0) return false;
+    {
+        std::lock_guard<std::mutex> lock(segments_mutex_);
+        segments_.clear();
+        Segment& segment = segments_.emplace_back();
+        segment.end = file.st_size - 1;
+        segment.done = file.st_size;
+        total_size_ = file.st_size;
+    }
+    // A 304 need not repeat the validators
+    result.remote = info;
+    result.remote.size = file.st_size;
+    if (result.remote.etag.empty()) result.remote.etag = previous.etag;
+    if (result.remote.last_modified.empty()) result.remote.last_modified = previous.last_modified;
+    result.mode = EngineMode::Single;
+    result.ok = true;
+    result.unchanged = true;
+    return true;
+}
+
+bool Download::merge_parts() {
+    // A new file rather than writing over the old one: that may be a hard
+    // link into the download cache (download_cache.h)
+    remove(options_.output.c_str());
+    std::ofstream outfile(options_.output, std::ios::binary);
+    for (const Segment& segment : segments_) {
+        std::string name = part_name(segment.id);
+        std::ifstream infile(name, std::ios::binary);
+        outfile << infile.rdbuf();
+        infile.close();
+        remove(name.c_str());
+    }
+    outfile.close();
+    return outfile.good();
+}
+
+void Download::remove_parts() {
+    for (const Segment& segment : segments_) remove(part_name(segment.id).c_str());
+}
+
+DownloadResult Download::run() {
+    DownloadResult result;
+    finished_ = false;
+    started_ = std::chrono::steady_clock::now();
+    long long job_started = trace_now();
+    metrics_gauge_add(MetricGauge::ActiveDownloads, 1);
+
+    while (true) {
+        // Asked to stop before anything got going (or while paused, for a cancel)
+        if (stop_ == StopRequest::Cancel) {
+            if (paused_) remove_parts();
+            paused_ = false;
+            result.cancelled = true;
+            result.error = "Cancelled";
+            break;
+        }
+        if (stop_ == StopRequest::Pause) {
+            result.paused = true;
+            result.error = "Paused";
+            break;
+        }
+
+        // A pause left the segments and their part files; carry on from there
+        bool resuming = paused_;
+        paused_ = false;
+        const PreviousCopy* previous = !resuming && use_previous_ ? options_.previous.get() : nullptr;
+        if (!resuming) refresh_hashes_.clear();
+
+        RemoteInfo info;
+        if (resuming) {
+            // If-Range still makes sure the rest comes from the same version of the file
+            info = paused_info_;
+        } else if (options_.probed && result.restarts == 0) {
+            info = options_.probed->info;
+            first_bytes_ = options_.probed->first_bytes;
+        } else {
+            long long probe_started = trace_now();
+            first_bytes_.clear();
+            info = probe_remote(options_.url, options_.small_file_limit, first_bytes_, previous);
+            trace_complete(trace_job_, TRACE_TRACK_JOB, "probe", probe_started, trace_now() - probe_started, info.size);
+        }
+        if (previous && (info.not_modified || (info.size > 0 && same_version(info, *previous)))) {
+            // Nothing new on the server: the copy we have is the file
+            if (!keep_previous(info, result)) result.error = "Could not write " + options_.output;
+            break;
+        }
+        if (info.size <= 0) {
+            result.error = "Could not get file size";
+            break;
+        }
+        if (!first_bytes_.empty()) note_first_byte();
+        result.remote = info;
+
+        if (!resuming && (long long)first_bytes_.size() == info.size) {
+            // A small file: the probe brought all of it, so there is nothing to split
+            result.mode = EngineMode::Single;
+            if (!write_whole_file()) result.error = "Could not write " + options_.output;
+            else result.ok = true;
+            break;
+        }
+
+        etag_ = info.etag.compare(0, 2, "W/") == 0 ? "" : info.etag;
+        restart_ = false;
+        std::string host = url_host(options_.url);
+        addresses_ = dns_lookup(host); // cached by the probe
+        alt_svc_update(host, info.alt_svc);
+        use_http3_ = options_.http3 && http3_supported() && alt_svc_has_http3(host, url_port(options_.url));
+        // QUIC multiplexes streams just like HTTP/2 does
+        info.http2 = info.http2 || use_http3_;
+
+        result.mode = resuming ? paused_mode_ : options_.mode;
+        if (result.mode == EngineMode::Auto) result.mode = choose_mode(host, info.http2);
+        int connections = result.mode == EngineMode::Single ? 1 : options_.num_threads;
+        bool refreshing = previous && plan_refresh(info, connections);
+        auto fetch_started = std::chrono::steady_clock::now();
+        bool complete = fetch_segments(info, result.mode, resuming || refreshing, result);
+        double fetch_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - fetch_started).count();
+
+        if (!complete && !restart_ && stop_ != StopRequest::None) {
+            if (stop_ == StopRequest::Cancel) {
+                remove_parts();
+                result.cancelled = true;
+                result.error = "Cancelled";
+            } else {
+                // Every segment knows how far it got and its part file has that much
+                paused_ = true;
+                paused_info_ = info;
+                paused_mode_ = result.mode;
+                result.paused = true;
+                result.error = "Paused";
+            }
+            break;
+        }
+
+        if (restart_) {
+            // The file changed while we were downloading it. Parts from two
+            // versions can't be stitched together, so start over.
+            remove_parts();
+            if (result.restarts >= options_.max_restarts) {
+                result.error = "The file kept changing on the server";
+                break;
+            }
+            result.restarts++;
+            metrics_add(MetricCounter::Restarts);
+            trace_instant(trace_job_, TRACE_TRACK_JOB, "restart", result.restarts);
+            continue;
+        }
+
+        if (!complete) {
+            result.error = "Gave up after " + std::to_string(options_.max_retries) + " retries";
+            remove_parts();
+            break;
+        }
+
+        // Only Auto learns from a job; a forced mode says nothing about the other one
+        // (and a refresh that fetched a few pieces says little about either)
+        if (options_.mode == EngineMode::Auto && !resuming && !refreshing && fetch_seconds > 0) {
+            record_mode_throughput(host, result.mode, info.size / fetch_seconds);
+        }
+
+        long long merge_started = trace_now();
+        bool merged = merge_parts();
+        trace_complete(trace_job_, TRACE_TRACK_JOB, "merge", merge_started, trace_now() - merge_started);
+        if (merged && !refresh_hashes_.empty() &&
+            piece_hashes(options_.output, refresh_piece_size_) != refresh_hashes_) {
+            // The old copy or the manifest wasn't what it claimed. Fetch all of it instead.
+            remove(options_.output.c_str());
+            use_previous_ = false;
+            result.restarts++;
+            metrics_add(MetricCounter::Restarts);
+            continue;
+        }
+        if (!merged) result.error = "Could not write " + options_.output;
+        else result.ok = true;
+        break;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    result.bytes = downloaded();
+    result.http3 = got_http3_;
+    result.seconds = std::chrono::duration<double>(now - started_).count();
+    if (got_first_byte_) result.first_byte = std::chrono::duration<double>(first_byte_at_ - started_).count();
+    metrics_gauge_add(MetricGauge::ActiveDownloads, -1);
+    // A pause isn't the end of the job, and a cancel isn't a failure
+    if (!result.paused && !result.cancelled) {
+        metrics_add(result.ok ? MetricCounter::JobsSucceeded : MetricCounter::JobsFailed);
+    }
+    if (trace_job_) {
+        trace_complete(trace_job_, TRACE_TRACK_JOB, "download", job_started, trace_now() - job_started, result.bytes);
+        trace_dump(trace_job_, options_.trace_path);
+    }
+    finished_ = true;
+    return result;
+}
+
+// --- 10. Probe Helpers ---
+static size_t read_probe_header(char* buffer, size_t size, size_t nitems, void* userdata) {
+    size_t len = size * nitems;
+    RemoteInfo* info = (RemoteInfo*)userdata;
+    std::string line(buffer, len);
+
+    if (starts_with_nocase(line, "HTTP/")) {
+        info->size = -1;
+        info->etag.clear();
+        info->last_modified.clear();
+        info->alt_svc.clear();
+        info->accepts_ranges = false;
+    } else if (starts_with_nocase(line, "ETag:")) {
+        info->etag = header_value(line);
+    } else if (starts_with_nocase(line, "Last-Modified:")) {
+        info->last_modified = header_value(line);
+    } else if (starts_with_nocase(line, "Accept-Ranges:")) {
+        info->accepts_ranges = header_value(line) == "bytes";
+    } else if (starts_with_nocase(line, "Alt-Svc:")) {
+        info->alt_svc = header_value(line);
+    } else if (starts_with_nocase(line, "Content-Range:")) {
+        // Only a range probe gets one. It has to start at 0 for the body to be of any use.
+        long long first = -1, last = -1, total = -1;
+        if (sscanf(header_value(line).c_str(), "bytes %lld-%lld/%lld", &first, &last, &total) == 3 && first == 0) {
+            info->size = total;
+            info->accepts_ranges = true;
+        }
+    }
+    return len;
+}
+
+// If-None-Match / If-Modified-Since for the copy we have. Free the list after the request.
+static curl_slist* conditional_headers(CURL* curl, const PreviousCopy* previous) {
+    if (!previous) return nullptr;
+    curl_slist* headers = nullptr;
+    if (!previous->etag.empty()) headers = curl_slist_append(headers, ("If-None-Match: " + previous->etag).c_str());
+    if (!previous->last_modified.empty()) {
+        headers = curl_slist_append(headers, ("If-Modified-Since: " + previous->last_modified).c_str());
+    }
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    return headers;
+}
+
+RemoteInfo probe_url(const std::string& url, const PreviousCopy* previous) {
+    init_curl_once();
+    RemoteInfo info;
+    std::string host = url_host(url);
+    CURL* curl = borrow_handle(host);
+    if(curl) {
+        curl_slist* headers = conditional_headers(curl, previous);
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+        curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+        curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+        curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, read_probe_header);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, &info);
+        if (perform_with_dns_cache(curl, host, [&]{ info = RemoteInfo(); }) == CURLE_OK) {
+            curl_off_t size = -1;
+            long status = 0, version = 0;
+            curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &size);
+            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+            curl_easy_getinfo(curl, CURLINFO_HTTP_VERSION, &version);
+            info.size = size;
+            info.not_modified = status == 304;
+            info.http2 = version == CURL_HTTP_VERSION_2_0;
+        }
+        return_handle(host, curl);
+        curl_slist_free_all(headers);
+    }
+    return info;
+}
+
+struct RangeProbe {
+    std::string* body;
+    size_t limit;
+};
+
+static size_t read_probe_body(char* ptr, size_t size, size_t nmemb, void* userdata) {
+    RangeProbe* probe = (RangeProbe*)userdata;
+    size_t len = size * nmemb;
+    // A server that ignored the Range sends the whole file. Keep the start and hang up.
+    size_t keep = std::min(len, probe->limit - probe->body->size());
+    probe->body->append(ptr, keep);
+    metrics_add(MetricCounter::BytesReceived, keep);
+    return keep == len ? len : 0;
+}
+
+RemoteInfo probe_with_range(const std::string& url, long long limit, std::string& first_bytes,
+                            const PreviousCopy* previous) {
+    init_curl_once();
+    RemoteInfo info;
+    first_bytes.clear();
+    std::string host = url_host(url);
+    CURL* curl = borrow_handle(host);
+    if (!curl) return info;
+    curl_slist* headers = conditional_headers(curl, previous);
+
+    RangeProbe probe = {&first_bytes, (size_t)limit};
+    std::string range = "0-" + std::to_string(limit - 1);
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_RANGE, range.c_str());
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 30L);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, read_probe_header);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &info);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, read_probe_body);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &probe);
+    CURLcode code = perform_with_dns_cache(curl, host, [&]{
+        info = RemoteInfo();
+        first_bytes.clear();
+    });
+
+    long status = 0, version = 0;
+    curl_off_t length = -1;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    curl_easy_getinfo(curl, CURLINFO_HTTP_VERSION, &version);
+    curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+    return_handle(host, curl);
+    curl_slist_free_all(headers);
+    info.http2 = version == CURL_HTTP_VERSION_2_0;
+
+    if (status == 304 && code == CURLE_OK) {
+        info.not_modified = true;
+        info.size = -1;
+    } else if (status == 200) {
+        // No Range support: the body is the file itself, from the start.
+        // If we got all of it we know the size even without a Content-Length.
+        info.accepts_ranges = false;
+        info.size = code == CURLE_OK ? (long long)first_bytes.size() : length;
+    } else if (status != 206 || info.size < 0) {
+        // An error, or a range that didn't start at 0. A cut-off 206 is
+        // fine: its size is known and what did arrive is still the start.
+        info.size = -1;
+        first_bytes.clear();
+    }
+    if (info.size >= 0 && (long long)first_bytes.size() > info.size) first_bytes.resize(info.size);
+    return info;
+}
+
+RemoteInfo probe_remote(const std::string& url, long long small_file_limit, std::string& first_bytes,
+                        const PreviousCopy* previous) {
+    first_bytes.clear();
+    return small_file_limit > 0 ? probe_with_range(url, small_file_limit, first_bytes, previous)
+                                : probe_url(url, previous);
+}
+
+long long get_size(const std::string& url) {
+    return probe_url(url).size;
+}
+
+bool still_current(const std::string& url, const std::string& etag, const std::string& last_modified) {
+    if (etag.empty() && last_modified.empty()) return false;
+    PreviousCopy copy;
+    copy.etag = etag;
+    copy.last_modified = last_modified;
+    RemoteInfo info = probe_url(url, &copy);
+    return info.not_modified || (info.size >= 0 && same_version(info, copy));
+}
+
+bool same_version(const RemoteInfo& info, const PreviousCopy& copy) {
+    // Weak ETags only promise the same meaning, not the same bytes
+    if (!copy.etag.empty() && copy.etag.compare(0, 2, "W/") != 0) return info.etag == copy.etag;
+    return copy.etag.empty() && info.etag.empty() && !copy.last_modified.empty() &&
+           info.last_modified == copy.last_modified;
+}
+
+// A reflink: copy-on-write on btrfs and XFS, so no bytes move and the two
+// stay independent. False (and no `to`) where the file system can't.
+static bool reflink(int in, const std::string& to) {
+    int out = open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (out < 0) return false;
+    bool ok = ioctl(out, FICLONE, in) == 0;
+    close(out);
+    if (!ok) unlink(to.c_str());
+    return ok;
+}
+
+bool copy_file(const std::string& from, const std::string& to) {
+    int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) return false;
+    if (reflink(in, to)) {
+        close(in);
+        return true;
+    }
+    int out = open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    bool ok = out >= 0;
+    ssize_t n = 0;
+    while (ok && (n = copy_file_range(in, nullptr, out, nullptr, 1 << 30, 0)) > 0) {}
+    ok = ok && n == 0;
+    close(in);
+    if (out >= 0 && close(out) != 0) ok = false;
+    if (!ok && out >= 0) unlink(to.c_str());
+    return ok;
+}
+
+bool clone_file(const std::string& from, const std::string& to) {
+    int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) return false;
+    bool done = reflink(in, to) || link(from.c_str(), to.c_str()) == 0;
+    close(in);
+    return done || copy_file(from, to); // another file system
+}
+
+bool clone_into_place(const std::string& from, const std::string& to) {
+    if (from == to) return true;
+    std::string temp = to + ".clone";
+    unlink(temp.c_str());
+    if (clone_file(from, temp) && rename(temp.c_str(), to.c_str()) == 0) return true;
+    unlink(temp.c_str());
+    return false;
+}
+
+std::string url_host(const std::string& url) {
+    std::string host;
+    CURLU* parsed = curl_url();
+    char* part = nullptr;
+    if (curl_url_set(parsed, CURLUPART_URL, url.c_str(), 0) == CURLUE_OK &&
+        curl_url_get(parsed, CURLUPART_HOST, &part, 0) == CURLUE_OK) {
+        host = part;
+        curl_free(part);
+    }
+    curl_url_cleanup(parsed);
+    return host;
+}
+
+std::string normalize_url(const std::string& url) {
+    std::string normalized = url;
+    CURLU* parsed = curl_url();
+    char* part = nullptr;
+    // curl lowercases the scheme and resolves the dots on the way in
+    if (curl_url_set(parsed, CURLUPART_URL, url.c_str(), 0) == CURLUE_OK &&
+        curl_url_get(parsed, CURLUPART_HOST, &part, 0) == CURLUE_OK) {
+        std::string host = part;
+        curl_free(part);
+        std::transform(host.begin(), host.end(), host.begin(), [](unsigned char c) { return std::tolower(c); });
+        curl_url_set(parsed, CURLUPART_HOST, host.c_str(), 0);
+        curl_url_set(parsed, CURLUPART_FRAGMENT, nullptr, 0);
+        if (curl_url_get(parsed, CURLUPART_URL, &part, CURLU_NO_DEFAULT_PORT) == CURLUE_OK) {
+            normalized = part;
+            curl_free(part);
+        }
+    }
+    curl_url_cleanup(parsed);
+    return normalized;
+}
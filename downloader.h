@@ -0,0 +1,221 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// --- The Download Engine ---
+// Everything needed to fetch one file over several HTTP Range connections.
+// final_downloader.cpp is the command line front end for it, range_bench.cpp
+// drives it against a local server.
+
+enum class EngineMode {
+    Single,      // one connection for the whole file
+    Segmented,   // num_threads connections, one Range each
+    Multiplexed, // num_threads Ranges as HTTP/2 streams over multiplex_connections connections
+    Auto,        // pick Segmented or Multiplexed per host, from the throughput each one got before
+};
+
+const char* engine_mode_name(EngineMode mode);
+bool parse_engine_mode(const std::string& name, EngineMode& mode);
+
+// What a HEAD request tells us about the file
+struct RemoteInfo {
+    long long size = -1;
+    std::string etag;
+    std::string last_modified; // raw header, "" if there was none
+    bool not_modified = false; // a conditional probe got a 304: the caller's copy is current
+    bool accepts_ranges = false;
+    bool http2 = false; // the server spoke HTTP/2, so streams can share a connection
+    std::string alt_svc; // raw Alt-Svc header, "" if there was none
+};
+
+// A probe done before the job started (see resolve_stage.h)
+struct ProbeResult {
+    RemoteInfo info;
+    std::string first_bytes; // what a range probe already brought, from offset 0
+};
+
+// A copy of an earlier version we already have (see DownloadOptions::previous)
+struct PreviousCopy {
+    std::string path;
+    std::string etag;          // the validators it came with
+    std::string last_modified;
+    // The server's piece manifest of the current version (piece_manifest.h),
+    // "" if it has none. With one, a changed file is refreshed by fetching
+    // only the pieces that differ from `path`.
+    std::string manifest_url;
+};
+
+struct DownloadOptions {
+    std::string url;                  // direct link to the file (already extracted)
+    std::string output = "video.mp4";
+    EngineMode mode = EngineMode::Segmented;
+    int num_threads = 4;
+    int multiplex_connections = 1;    // connections Multiplexed mode spreads its streams over
+    long long small_file_limit = 1 << 20; // the probe GETs this much, so smaller files take one request
+                                          // (0 = probe with HEAD instead)
+    // Local interfaces or source IPs to spread segments over, in any form
+    // CURLOPT_INTERFACE takes ("eth1", "if!eth1", "192.0.2.7"). Empty = the OS picks.
+    std::vector<std::string> interfaces;
+    bool http3 = false;               // use HTTP/3 where the host advertised it (falls back to TCP on its own)
+    int max_retries = 5;              // per segment, before we give up on the file
+    int max_restarts = 3;             // times we start over because the file changed under us
+    std::string trace_path;           // write a Chrome trace of this job here ("" = no tracing)
+    // Used instead of probing on the first attempt. A restart probes afresh.
+    std::shared_ptr<const ProbeResult> probed;
+    // Makes the probe a conditional request. If the server says this copy is
+    // still current it goes to `output` and nothing is downloaded; if it
+    // changed, see PreviousCopy::manifest_url.
+    std::shared_ptr<const PreviousCopy> previous;
+};
+
+struct DownloadResult {
+    bool ok = false;
+    long long bytes = 0;
+    double seconds = 0;      // wall clock from the size probe to the merged file
+    double first_byte = 0;   // seconds until the first body byte arrived
+    int retries = 0;
+    int restarts = 0;
+    EngineMode mode = EngineMode::Segmented; // what actually ran (Auto resolves to one of the others)
+    bool http3 = false;      // at least one segment came over HTTP/3
+    bool paused = false;     // stopped by pause(); run() again to carry on
+    bool cancelled = false;  // stopped by cancel()
+    bool unchanged = false;  // options.previous was still current and is now at options.output
+    RemoteInfo remote;       // what the server said about the version we got
+    std::string error;
+};
+
+// One Range request worth of work. The dashboard reads `done` while the
+// download thread is still writing it, hence the atomic.
+struct Segment {
+    int id = 0;
+    long long start = 0;
+    long long end = 0; // inclusive, like the Range header
+    std::atomic<long long> done{0};
+    int retries = 0;
+
+    long long length() const { return end - start + 1; }
+};
+
+struct SegmentProgress {
+    int id;
+    long long length;
+    long long done;
+};
+
+class WriteQueue;
+struct SegmentTransfer;
+
+class Download {
+public:
+    explicit Download(DownloadOptions options);
+    ~Download();
+    Download(const Download&) = delete;
+    Download& operator=(const Download&) = delete;
+
+    // Blocks until the file is on disk (or we gave up). After a pause,
+    // resume() and run() again to fetch only what is still missing.
+    DownloadResult run();
+
+    // Safe to call from any thread, running or not. Every transfer stops at
+    // its next callback and closes its connection, and run() returns.
+    // pause() keeps the part files; cancel() has run() remove them (run() a
+    // paused download after cancel() to clean up after it).
+    void pause();
+    void resume();
+    void cancel();
+
+    // Safe to call from another thread while run() is going
+    long long total_size() const { return total_size_.load(); }
+    long long downloaded() const;
+    bool finished() const { return finished_.load(); }
+    std::vector<SegmentProgress> progress() const;
+
+private:
+    friend struct SegmentTransfer;
+    friend size_t write_data(void* ptr, size_t size, size_t nmemb, void* userdata);
+
+    enum class StopRequest { None, Pause, Cancel };
+
+    bool fetch_segments(const RemoteInfo& info, EngineMode mode, bool resuming, DownloadResult& result);
+    bool setup_transfer(SegmentTransfer& data);
+    bool start_attempt(SegmentTransfer& data);
+    bool end_attempt(SegmentTransfer& data, int code); // code is the CURLcode of the request
+    void finish_transfer(SegmentTransfer& data);
+    void download_segment(Segment& segment);
+    void download_multiplexed(bool http2);
+    bool plan_refresh(const RemoteInfo& info, int connections);
+    bool keep_previous(const RemoteInfo& info, DownloadResult& result);
+    bool merge_parts();
+    bool write_whole_file();
+    void remove_parts();
+    std::string part_name(int id) const;
+    void note_first_byte();
+
+    DownloadOptions options_;
+    uint32_t trace_job_ = 0;            // 0 unless options_.trace_path is set
+    std::string etag_;                  // validator from the probe, "" if we can't rely on one
+    std::atomic<bool> restart_{false};  // a segment saw a different version of the file
+    std::atomic<StopRequest> stop_{StopRequest::None};
+    // Set when a pause left segments_ and their part files behind for the next run()
+    bool paused_ = false;
+    RemoteInfo paused_info_;
+    EngineMode paused_mode_ = EngineMode::Segmented;
+    // Set by plan_refresh(): the pieces the merged file has to hash to
+    std::vector<std::string> refresh_hashes_;
+    long long refresh_piece_size_ = 0;
+    bool use_previous_ = true;          // until a refresh from it went wrong
+    std::string first_bytes_;           // start of the file, fetched by the probe
+    std::vector<std::string> addresses_; // the host's addresses, segments are spread over them
+    std::vector<std::string> segment_edges_;   // address each segment starts out on, by id
+    std::vector<std::string> segment_sources_; // local interface each segment goes out on, by id
+    bool use_http3_ = false;            // this round of segments starts out on HTTP/3
+    std::atomic<bool> got_http3_{false};
+    mutable std::mutex segments_mutex_; // held while segments_ is rebuilt
+    std::deque<Segment> segments_;
+    std::vector<std::ofstream> parts_; // opened by run(), written only by the writer
+    std::unique_ptr<WriteQueue> writer_;
+    std::atomic<long long> total_size_{0};
+    std::atomic<bool> finished_{false};
+    std::atomic<bool> got_first_byte_{false};
+    std::chrono::steady_clock::time_point started_;
+    std::chrono::steady_clock::time_point first_byte_at_;
+};
+
+// --- Helpers ---
+bool http3_supported(); // the libcurl we run against was built with HTTP/3
+// With `previous`, the probes are conditional requests against its validators
+RemoteInfo probe_url(const std::string& url, const PreviousCopy* previous = nullptr);
+// probe_with_range() up to `small_file_limit`, or probe_url() when that is 0, like a download does
+RemoteInfo probe_remote(const std::string& url, long long small_file_limit, std::string& first_bytes,
+                        const PreviousCopy* previous = nullptr);
+// GETs the first `limit` bytes instead of a HEAD, so small files arrive whole
+RemoteInfo probe_with_range(const std::string& url, long long limit, std::string& first_bytes,
+                            const PreviousCopy* previous = nullptr);
+long long get_size(const std::string& url);
+// HEAD with If-None-Match / If-Modified-Since. True when the server says the
+// copy these validators came with is still current: a 304, or the same
+// strong ETag from a server that ignores conditional requests.
+bool still_current(const std::string& url, const std::string& etag, const std::string& last_modified);
+// What a probe found is the version `copy` came with (same strong ETag, or no
+// ETags and the same Last-Modified)
+bool same_version(const RemoteInfo& info, const PreviousCopy& copy);
+// Makes `to` the same file as `from`: a reflink, else a hard link, else a
+// copy. `to` must not exist.
+bool clone_file(const std::string& from, const std::string& to);
+// Like clone_file() but never a hard link, so `to` is a file of its own
+bool copy_file(const std::string& from, const std::string& to);
+// clone_file() next to `to`, then renamed over it, so an old `to` is
+// replaced in one step
+bool clone_into_place(const std::string& from, const std::string& to);
+std::string url_host(const std::string& url);
+// The form two spellings of one URL share: scheme and host lowercased, no
+// default port, no fragment, "." and ".." resolved. Unparseable URLs come back as given.
+std::string normalize_url(const std::string& url);
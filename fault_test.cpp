@@ -0,0 +1,513 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <dirent.h>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include "dns_cache.h"
+#include "download_cache.h"
+#include "downloader.h"
+#include "range_server.h"
+#include "resolve_stage.h"
+
+// --- Fault Injection Harness ---
+// Runs the engine against a local RangeServer that misbehaves in specific,
+// repeatable ways and checks that what lands on disk is byte-for-byte the
+// file the server was serving. Exits non-zero if any case fails.
+
+const std::string FILE_NAME = "file.bin";
+const long long FILE_SIZE = 3 * 1024 * 1024 + 123; // uneven on purpose
+
+enum class Interrupt { None, Pause, Cancel };
+
+// Everything but the name has a default; each case sets only what it is about:
+//   TestCase("short bodies").with_faults({...}).with_check(...)
+struct TestCase {
+    std::string name;
+    std::vector<Fault> faults;
+    EngineMode mode = EngineMode::Segmented;
+    bool expect_ok = true;
+    // Extra checks once the download is done. Return "" when happy.
+    std::function<std::string(RangeServer&, const DownloadResult&)> check;
+    long long file_size = FILE_SIZE;
+    // Off by default so every GET a fault counts is a segment request
+    long long small_file_limit = 0;
+    std::string host; // put in the URL instead of 127.0.0.1 (see the dns_add_static calls in main)
+    // Anything else the case needs from the server or the engine
+    std::function<void(RangeServerConfig&, DownloadOptions&)> configure;
+    int runs = 1; // downloads of the same file, for cases about what the engine learns
+    bool resolve_ahead = false; // queue a page URL through a ResolveStage with a stub resolver first
+    // Once a third of the file is in. Pause: check that let go of every connection, then resume.
+    Interrupt interrupt = Interrupt::None;
+    // Like `check`, for checks that talk to the server: runs before it stops
+    std::function<std::string(RangeServer&, const DownloadOptions&, const DownloadResult&)> check_serving;
+
+    explicit TestCase(std::string name) : name(std::move(name)) {}
+    TestCase& with_faults(std::vector<Fault> value) { faults = std::move(value); return *this; }
+    TestCase& with_mode(EngineMode value) { mode = value; return *this; }
+    TestCase& expect_failure() { expect_ok = false; return *this; }
+    TestCase& with_check(decltype(check) value) { check = std::move(value); return *this; }
+    TestCase& with_file_size(long long value) { file_size = value; return *this; }
+    TestCase& with_small_file_limit(long long value) { small_file_limit = value; return *this; }
+    TestCase& with_host(std::string value) { host = std::move(value); return *this; }
+    TestCase& with_config(decltype(configure) value) { configure = std::move(value); return *this; }
+    TestCase& with_runs(int value) { runs = value; return *this; }
+    TestCase& with_resolve_ahead() { resolve_ahead = true; return *this; }
+    TestCase& with_interrupt(Interrupt value) { interrupt = value; return *this; }
+    TestCase& with_serving_check(decltype(check_serving) value) { check_serving = std::move(value); return *this; }
+};
+
+static std::string temp_dir;
+
+static bool same_as_server(const std::string& path, int version, long long size) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) return false;
+    std::vector<char> got(1 << 16), want(1 << 16);
+    long long offset = 0;
+    bool same = true;
+    while (same) {
+        size_t n = fread(got.data(), 1, got.size(), f);
+        if (n == 0) break;
+        RangeServer::fill(FILE_NAME, offset, want.data(), n, version);
+        same = std::equal(got.begin(), got.begin() + n, want.begin());
+        offset += n;
+    }
+    fclose(f);
+    return same && offset == size;
+}
+
+// An independent copy of `from` (not a link: it may get damaged), with the
+// `damage` bytes at `at` overwritten
+static bool copy_with_damage(const std::string& from, const std::string& to, long long at = 0, long long damage = 0) {
+    std::ifstream in(from, std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (!in.good() && !in.eof()) return false;
+    for (long long i = at; i < at + damage && i < (long long)data.size(); i++) data[i] ^= 0x5a;
+    std::ofstream out(to, std::ios::binary | std::ios::trunc);
+    out.write(data.data(), data.size());
+    out.close();
+    return out.good();
+}
+
+// Downloads the file again into again.bin, with `previous` as the copy we
+// already have. The copy and the output are removed afterwards.
+static std::string download_again(RangeServer& server, const DownloadOptions& options,
+                                   std::shared_ptr<PreviousCopy> previous, DownloadResult& result,
+                                   long long& requests, long long& bytes_sent) {
+    DownloadOptions again = options;
+    again.output = temp_dir + "/again.bin";
+    again.previous = previous;
+    requests = server.requests();
+    bytes_sent = server.bytes_sent();
+    result = Download(again).run();
+    // The server counts a body once it's out, which may be after the client has it
+    for (int i = 0; i < 200 && server.busy_connections() > 0; i++) usleep(5000);
+    requests = server.requests() - requests;
+    bytes_sent = server.bytes_sent() - bytes_sent;
+    std::string problem;
+    if (!result.ok) problem = "the second download failed: " + result.error;
+    else if (!same_as_server(again.output, server.version(FILE_NAME), FILE_SIZE)) problem = "the second output differs";
+    remove(again.output.c_str());
+    remove(previous->path.c_str());
+    return problem;
+}
+
+static int leftover_files() {
+    int count = 0;
+    DIR* dir = opendir(temp_dir.c_str());
+    if (!dir) return 0;
+    while (dirent* entry = readdir(dir)) {
+        if (entry->d_name[0] != '.') count++;
+    }
+    closedir(dir);
+    return count;
+}
+
+static bool run_case(const TestCase& test) {
+    RangeServerConfig config;
+    DownloadOptions options;
+    if (test.configure) test.configure(config, options);
+    RangeServer server(config);
+    server.add_file(FILE_NAME, test.file_size);
+    for (const Fault& fault : test.faults) server.add_fault(fault);
+    if (server.start() < 0) {
+        std::cout << "[FAIL] " << test.name << ": could not start the server\n";
+        return false;
+    }
+
+    options.url = server.url(FILE_NAME);
+    if (!test.host.empty()) options.url.replace(options.url.find("127.0.0.1"), 9, test.host);
+    options.output = temp_dir + "/out.bin";
+    options.mode = test.mode;
+    options.num_threads = 4;
+    options.small_file_limit = test.small_file_limit;
+
+    if (test.resolve_ahead) {
+        std::string page = "https://video.test/watch?v=" + FILE_NAME;
+        ResolveStage stage(std::make_shared<StubResolver>(std::map<std::string, std::vector<std::string>>{
+                               {page, {options.url}}}),
+                           1, 1, options.small_file_limit);
+        stage.push({{1, page}});
+        ResolvedJob job;
+        stage.pop(job);
+        if (!job.links.empty()) {
+            options.url = job.links.front();
+            options.probed = job.probes.front();
+        }
+    }
+
+    DownloadResult result;
+    std::string interrupt_problem;
+    for (int run = 0; run < test.runs && (run == 0 || result.ok); run++) {
+        Download download(options);
+        if (test.interrupt == Interrupt::None) {
+            result = download.run();
+            continue;
+        }
+
+        std::thread interrupter([&] {
+            for (int i = 0; i < 1000 && download.downloaded() < test.file_size / 3; i++) usleep(5000);
+            if (test.interrupt == Interrupt::Pause) download.pause();
+            else download.cancel();
+        });
+        result = download.run();
+        interrupter.join();
+        if (test.interrupt == Interrupt::Cancel) {
+            if (!result.cancelled) interrupt_problem = "run() did not stop for the cancel";
+            break;
+        }
+        if (!result.paused) {
+            interrupt_problem = "run() did not stop for the pause";
+            break;
+        }
+        // Aborted transfers close their connections; give the server a moment to notice
+        for (int i = 0; i < 200 && server.busy_connections() > 0; i++) usleep(5000);
+        if (server.busy_connections() > 0) {
+            interrupt_problem = std::to_string(server.busy_connections()) + " transfers still going while paused";
+            break;
+        }
+        download.resume();
+        result = download.run();
+    }
+    int version = server.version(FILE_NAME); // what was downloaded, whatever check_serving does to it
+    std::string serving_problem;
+    if (test.check_serving && result.ok == test.expect_ok) serving_problem = test.check_serving(server, options, result);
+    server.stop();
+
+    std::string problem;
+    if (!interrupt_problem.empty()) {
+        problem = interrupt_problem;
+    } else if (result.ok != test.expect_ok) {
+        problem = result.ok ? "expected the download to fail" : "download failed: " + result.error;
+    } else if (result.ok && !same_as_server(options.output, version, test.file_size)) {
+        problem = "output differs from what the server holds";
+    } else if (!result.ok && leftover_files() != 0) {
+        problem = "left part files behind";
+    } else if (!serving_problem.empty()) {
+        problem = serving_problem;
+    } else if (test.check) {
+        problem = test.check(server, result);
+    }
+
+    remove(options.output.c_str());
+    std::cout << (problem.empty() ? "[ OK ] " : "[FAIL] ") << test.name;
+    if (!problem.empty()) std::cout << ": " << problem;
+    std::cout << " (retries " << result.retries << ", restarts " << result.restarts << ")\n";
+    return problem.empty();
+}
+
+int main() {
+    char dir_template[] = "/tmp/fault_test_XXXXXX";
+    temp_dir = mkdtemp(dir_template);
+
+    // Every 127.x address is loopback, so these reach the test server (when it listens on them)
+    dns_add_static("two-addresses.test", {"127.0.0.1", "127.0.0.2"});
+    dns_add_static("one-address-down.test", {"127.0.0.3", "127.0.0.1"});
+    dns_add_static("uneven-addresses.test", {"127.0.0.1", "127.0.0.2"});
+
+    std::vector<TestCase> cases = {
+        TestCase("clean download").with_check([](RangeServer& server, const DownloadResult&) {
+            // One HEAD plus one GET per segment, nothing else
+            return server.requests() == 5 ? "" : "made " + std::to_string(server.requests()) + " requests";
+        }),
+
+        TestCase("connection dropped mid-range")
+            .with_faults({{FaultKind::DropAfter, 2, 100000}})
+            .with_check([](RangeServer& server, const DownloadResult& result) -> std::string {
+                if (result.retries != 1) return "expected exactly one retry";
+                // Resuming means the bytes we already had are not fetched again
+                if (server.bytes_sent() != FILE_SIZE) return "refetched data it already had";
+                return "";
+            }),
+
+        TestCase("every first attempt dropped")
+            .with_faults({{FaultKind::DropAfter, 1, 0}, {FaultKind::DropAfter, 2, 0},
+                          {FaultKind::DropAfter, 3, 0}, {FaultKind::DropAfter, 4, 0}}),
+
+        TestCase("200 instead of 206").with_faults({{FaultKind::IgnoreRange, 2}, {FaultKind::IgnoreRange, 3}}),
+
+        TestCase("server without range support").with_faults({{FaultKind::IgnoreRange, 0}}),
+
+        TestCase("short bodies")
+            .with_faults({{FaultKind::ShortBody, 1, 1000}, {FaultKind::ShortBody, 3, 1}})
+            .with_check([](RangeServer&, const DownloadResult& result) {
+                return result.retries == 2 ? "" : "expected a follow-up request per short body";
+            }),
+
+        TestCase("ETag changes mid-download")
+            .with_faults({{FaultKind::ChangeVersion, 3}})
+            .with_check([](RangeServer& server, const DownloadResult& result) -> std::string {
+                if (result.restarts != 1) return "expected exactly one restart";
+                if (server.version(FILE_NAME) != 2) return "server never changed version";
+                return "";
+            }),
+
+        TestCase("ETag never settles").with_faults({{FaultKind::ChangeVersion, 0}}).expect_failure(),
+
+        TestCase("one throttled connection").with_faults({{FaultKind::Throttle, 1, 256 * 1024}}),
+
+        TestCase("single connection with drops")
+            .with_faults({{FaultKind::DropAfter, 1, 1024 * 1024}, {FaultKind::DropAfter, 2, 1024 * 1024}})
+            .with_mode(EngineMode::Single)
+            .with_check([](RangeServer& server, const DownloadResult&) {
+                return server.bytes_sent() == FILE_SIZE ? "" : "refetched data it already had";
+            }),
+
+        TestCase("multiplexed with drops and short bodies")
+            .with_faults({{FaultKind::DropAfter, 1, 100000}, {FaultKind::ShortBody, 3, 1000}, {FaultKind::IgnoreRange, 4}})
+            .with_mode(EngineMode::Multiplexed),
+
+        TestCase("multiplexed, ETag changes mid-download")
+            .with_faults({{FaultKind::ChangeVersion, 3}})
+            .with_mode(EngineMode::Multiplexed)
+            .with_check([](RangeServer&, const DownloadResult& result) {
+                return result.restarts == 1 ? "" : "expected exactly one restart";
+            }),
+
+        TestCase("small file in one request")
+            .with_file_size(200000)
+            .with_small_file_limit(1 << 20)
+            .with_check([](RangeServer& server, const DownloadResult&) {
+                return server.requests() == 1 ? "" : "made " + std::to_string(server.requests()) + " requests";
+            }),
+
+        TestCase("small file from a server without range support")
+            .with_faults({{FaultKind::IgnoreRange, 0}})
+            .with_file_size(200000)
+            .with_small_file_limit(1 << 20)
+            .with_check([](RangeServer& server, const DownloadResult&) {
+                return server.requests() == 1 ? "" : "made " + std::to_string(server.requests()) + " requests";
+            }),
+
+        TestCase("probe bytes reused by the segments")
+            .with_small_file_limit(1 << 20)
+            .with_check([](RangeServer& server, const DownloadResult&) -> std::string {
+                if (server.bytes_sent() != FILE_SIZE) return "refetched data it already had";
+                // The probe covers all of segment 0, and its connection goes on to serve another segment
+                if (server.requests() != 4) return "made " + std::to_string(server.requests()) + " requests";
+                if (server.connections() != 3) return "opened " + std::to_string(server.connections()) + " connections";
+                return "";
+            }),
+
+        TestCase("large file without range support, probe on")
+            .with_faults({{FaultKind::IgnoreRange, 0}})
+            .with_small_file_limit(1 << 20),
+
+        TestCase("segments spread over every address")
+            .with_host("two-addresses.test")
+            .with_config([](RangeServerConfig& config, DownloadOptions&) { config.bind_address = "0.0.0.0"; })
+            .with_check([](RangeServer& server, const DownloadResult&) -> std::string {
+                // The HEAD plus segments 0 and 2 on the first address, 1 and 3 on the second
+                std::map<std::string, int> seen = server.requests_by_address();
+                if (seen["127.0.0.1"] != 3 || seen["127.0.0.2"] != 2) return "segments were not spread evenly";
+                return "";
+            }),
+
+        TestCase("unreachable address skipped")
+            .with_host("one-address-down.test")
+            .with_check([](RangeServer&, const DownloadResult& result) {
+                // Only the probe should have run into it
+                return result.retries == 0 ? "" : "segments kept trying the dead address";
+            }),
+
+        TestCase("segments steered to the faster address")
+            .with_host("uneven-addresses.test")
+            .with_config([](RangeServerConfig& config, DownloadOptions&) {
+                config.bind_address = "0.0.0.0";
+                config.bandwidth_by_address["127.0.0.2"] = 2 * 1024 * 1024;
+            })
+            .with_runs(2)
+            .with_check([](RangeServer& server, const DownloadResult&) -> std::string {
+                // The first download splits evenly and finds 127.0.0.2 slow; the second stays off it
+                std::map<std::string, int> seen = server.requests_by_address();
+                if (seen["127.0.0.2"] != 2) return std::to_string(seen["127.0.0.2"]) + " requests went to the slow address";
+                return "";
+            }),
+
+        // Source addresses are remembered across hosts, so every case gets its own
+        TestCase("segments spread over local interfaces")
+            .with_config([](RangeServerConfig&, DownloadOptions& options) { options.interfaces = {"127.0.0.1", "127.0.0.4"}; })
+            .with_check([](RangeServer& server, const DownloadResult&) -> std::string {
+                // The HEAD goes out however the OS likes (127.0.0.1), the segments take turns
+                std::map<std::string, int> seen = server.requests_by_client();
+                if (seen["127.0.0.1"] != 3 || seen["127.0.0.4"] != 2) return "segments were not spread evenly";
+                return "";
+            }),
+
+        TestCase("segments steered to the faster interface")
+            .with_config([](RangeServerConfig& config, DownloadOptions& options) {
+                options.interfaces = {"127.0.0.5", "127.0.0.6"};
+                config.bandwidth_by_client["127.0.0.6"] = 2 * 1024 * 1024;
+            })
+            .with_runs(2)
+            .with_check([](RangeServer& server, const DownloadResult&) -> std::string {
+                // Two segments per interface the first time, then all four on the fast one. The
+                // probes may ride any pooled connection, so they are not counted.
+                std::map<std::string, int> seen = server.requests_by_client();
+                if (seen["127.0.0.5"] < 6) return "only " + std::to_string(seen["127.0.0.5"]) + " requests used the fast interface";
+                return "";
+            }),
+
+        TestCase("probed ahead by the resolve stage")
+            .with_resolve_ahead()
+            .with_check([](RangeServer& server, const DownloadResult&) {
+                // The stage's HEAD is the only probe; the download goes straight to the segments
+                return server.requests() == 5 ? "" : "made " + std::to_string(server.requests()) + " requests";
+            }),
+
+        TestCase("paused and resumed")
+            .with_config([](RangeServerConfig& config, DownloadOptions&) { config.bandwidth = 1024 * 1024; })
+            .with_interrupt(Interrupt::Pause)
+            .with_check([](RangeServer& server, const DownloadResult&) -> std::string {
+                // What was in flight when the connections closed gets sent again, nothing more
+                if (server.bytes_sent() > FILE_SIZE * 5 / 4) return "refetched what it already had";
+                return "";
+            }),
+
+        TestCase("paused and resumed, multiplexed")
+            .with_mode(EngineMode::Multiplexed)
+            .with_config([](RangeServerConfig& config, DownloadOptions&) { config.bandwidth = 1024 * 1024; })
+            .with_interrupt(Interrupt::Pause)
+            .with_check([](RangeServer& server, const DownloadResult&) -> std::string {
+                if (server.bytes_sent() > FILE_SIZE * 5 / 4) return "refetched what it already had";
+                return "";
+            }),
+
+        TestCase("cancelled midway")
+            .expect_failure()
+            .with_config([](RangeServerConfig& config, DownloadOptions&) { config.bandwidth = 1024 * 1024; })
+            .with_interrupt(Interrupt::Cancel),
+
+        TestCase("served from the cache while current")
+            .with_serving_check([](RangeServer& server, const DownloadOptions& options, const DownloadResult& result) -> std::string {
+                std::string cache_dir = temp_dir + "/cache";
+                std::string copy = temp_dir + "/cached.bin";
+                std::string problem;
+                {
+                    DownloadCache cache(cache_dir, 1LL << 30);
+                    if (!cache.store({{options.url, result.remote.etag, result.remote.last_modified}}, options.output)) {
+                        return "could not store the download";
+                    }
+                    struct stat output;
+                    if (stat(options.output.c_str(), &output) != 0 || output.st_nlink != 1 || !(output.st_mode & S_IWUSR)) {
+                        return "storing tied the output to the cached file";
+                    }
+                    long long gets = server.requests();
+                    if (cache.fetch({options.url}, copy) != FILE_SIZE) problem = "a current copy was not used";
+                    else if (server.requests() != gets + 1) problem = "revalidating took more than one request";
+                    else if (!same_as_server(copy, 1, FILE_SIZE)) problem = "the cached copy differs";
+                    remove(copy.c_str());
+   
+                    // The file changes: the copy is stale and goes
+                    server.change_version(FILE_NAME);
+                    if (problem.empty() && cache.fetch({options.url}, copy) >= 0) problem = "served a stale copy";
+                    if (problem.empty() && cache.size() != 0) problem = "kept the stale copy";
+                }
+                remove((cache_dir + "/index").c_str());
+                rmdir((cache_dir + "/objects").c_str());
+                rmdir(cache_dir.c_str());
+                return problem;
+            }),
+
+        TestCase("unchanged file kept via a conditional GET")
+            .with_serving_check([](RangeServer& server, const DownloadOptions& options, const DownloadResult& result) -> std::string {
+                auto previous = std::make_shared<PreviousCopy>();
+                previous->path = temp_dir + "/previous.bin";
+                previous->etag = result.remote.etag;
+                if (!copy_with_damage(options.output, previous->path)) return "could not copy the download";
+                // The range probe is the conditional GET: a 304 and no body
+                DownloadOptions options_again = options;
+                options_again.small_file_limit = 1 << 20;
+                DownloadResult again;
+                long long requests, bytes_sent;
+                std::string problem = download_again(server, options_again, previous, again, requests, bytes_sent);
+                if (!problem.empty()) return problem;
+                if (!again.unchanged) return "downloaded an unchanged file again";
+                if (requests != 1 || bytes_sent != 0) {
+                    return "took " + std::to_string(requests) + " requests and " + std::to_string(bytes_sent) + " bytes";
+                }
+                return "";
+            }),
+
+        TestCase("only changed pieces refetched")
+            .with_config([](RangeServerConfig& config, DownloadOptions&) { config.piece_size = 256 * 1024; })
+            .with_serving_check([](RangeServer& server, const DownloadOptions& options, const DownloadResult&) -> std::string {
+                // An older version that differs from this one in a few bytes of the fifth piece
+                auto previous = std::make_shared<PreviousCopy>();
+                previous->path = temp_dir + "/previous.bin";
+                previous->etag = "\"older\"";
+                previous->manifest_url = server.url(FILE_NAME) + ".pieces";
+                if (!copy_with_damage(options.output, previous->path, 4 * 256 * 1024 + 1000, 100)) {
+                    return "could not copy the download";
+                }
+                DownloadResult again;
+                long long requests, bytes_sent;
+                std::string problem = download_again(server, options, previous, again, requests, bytes_sent);
+                if (!problem.empty()) return problem;
+                if (again.unchanged) return "took a changed file for unchanged";
+                if (bytes_sent != 256 * 1024) return "fetched " + std::to_string(bytes_sent) + " bytes for one piece";
+                return "";
+            }),
+
+        TestCase("new version with nothing in common fetched whole")
+            .with_config([](RangeServerConfig& config, DownloadOptions&) { config.piece_size = 256 * 1024; })
+            .with_serving_check([](RangeServer& server, const DownloadOptions& options, const DownloadResult&) -> std::string {
+                auto previous = std::make_shared<PreviousCopy>();
+                previous->path = temp_dir + "/previous.bin";
+                previous->etag = "\"older\"";
+                previous->manifest_url = server.url(FILE_NAME) + ".pieces";
+                if (!copy_with_damage(options.output, previous->path)) return "could not copy the download";
+                server.change_version(FILE_NAME); // every piece differs now
+                DownloadResult again;
+                long long requests, bytes_sent;
+                std::string problem = download_again(server, options, previous, again, requests, bytes_sent);
+                if (!problem.empty()) return problem;
+                if (again.unchanged || again.restarts != 0) return "expected a plain download of the new version";
+                if (bytes_sent != FILE_SIZE) return "fetched " + std::to_string(bytes_sent) + " bytes";
+                return "";
+            }),
+
+        TestCase("everything at once")
+            .with_faults({{FaultKind::Throttle, 1, 512 * 1024}, {FaultKind::DropAfter, 2, 4096}, {FaultKind::IgnoreRange, 3},
+                          {FaultKind::ShortBody, 4, 10}, {FaultKind::ChangeVersion, 6}, {FaultKind::DropAfter, 8, 50000},
+                          {FaultKind::IgnoreRange, 9}}),
+    };
+
+    int failed = 0;
+    for (const TestCase& test : cases) {
+        if (!run_case(test)) failed++;
+    }
+
+    rmdir(temp_dir.c_str());
+    std::cout << "\n" << cases.size() - failed << "/" << cases.size() << " passed\n";
+    return failed == 0 ? 0 : 1;
+}
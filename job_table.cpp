@@ -0,0 +1,227 @@
+#include "job_table.h"
+
+#include <algorithm>
+#include <iterator>
+#include "downloader.h"
+
+const char* job_state_name(JobState state) {
+    switch (state) {
+        case JobState::Queued: return "queued";
+        case JobState::Downloading: return "downloading";
+        case JobState::Paused: return "paused";
+        case JobState::Done: return "done";
+        case JobState::Failed: return "failed";
+        case JobState::Cancelled: return "cancelled";
+    }
+    return "unknown";
+}
+
+static bool is_finished(JobState state) {
+    return state == JobState::Done || state == JobState::Failed || state == JobState::Cancelled;
+}
+
+// --- 1. The Table ---
+uint64_t JobTable::add(const std::vector<std::string>& urls) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint64_t first = next_id_;
+    jobs_.reserve(jobs_.size() + urls.size());
+    for (const std::string& url : urls) {
+        uint64_t id = next_id_++;
+        Entry& entry = jobs_[id];
+        entry.status.id = id;
+        entry.status.url = url;
+        entry.status.version = ++version_;
+        entry.position = by_version_.insert(by_version_.end(), id);
+    }
+    return first;
+}
+
+bool JobTable::get(uint64_t id, JobStatus& out) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = jobs_.find(id);
+    if (it == jobs_.end()) return false;
+    out = it->second.status;
+    return true;
+}
+
+bool JobTable::update(uint64_t id, const std::function<bool(JobStatus&)>& change) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = jobs_.find(id);
+    if (it == jobs_.end()) return false;
+    Entry& entry = it->second;
+
+    // A withdrawn job stays cancelled; only its followers see the transfer move
+    JobStatus& target = entry.withdrawn ? entry.transfer : entry.status;
+    bool was_finished = is_finished(entry.status.state);
+    if (!change(target)) return true;
+    target.id = id; // not the caller's to change
+    if (!entry.withdrawn) changed(entry, was_finished);
+
+    for (uint64_t follower_id : entry.followers) {
+        auto follower = jobs_.find(follower_id);
+        if (follower == jobs_.end()) continue; // finished and forgotten
+        JobStatus& status = follower->second.status;
+        bool follower_was_finished = is_finished(status.state);
+        status.state = target.state;
+        status.downloaded = target.downloaded;
+        status.total = target.total;
+        status.output = target.output;
+        status.error = target.error;
+        changed(follower->second, follower_was_finished);
+    }
+    forget_finished();
+    return true;
+}
+
+bool JobTable::attach(uint64_t id, uint64_t to) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = jobs_.find(id);
+        auto target = jobs_.find(to);
+        if (it == jobs_.end() || target == jobs_.end() || id == to || target->second.status.same_as) return false;
+        target->second.followers.push_back(id);
+        it->second.status.same_as = to;
+    }
+    return update(to, [](JobStatus&) { return true; }); // copies it across
+}
+
+uint64_t JobTable::detach(uint64_t id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = jobs_.find(id);
+    if (it == jobs_.end() || !it->second.status.same_as) return 0;
+    uint64_t to = it->second.status.same_as;
+    it->second.status.same_as = 0;
+    changed(it->second, is_finished(it->second.status.state));
+
+    auto target = jobs_.find(to);
+    if (target != jobs_.end()) {
+        std::vector<uint64_t>& followers = target->second.followers;
+        followers.erase(std::remove(followers.begin(), followers.end(), id), followers.end());
+    }
+    return to;
+}
+
+bool JobTable::withdraw(uint64_t id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = jobs_.find(id);
+    if (it == jobs_.end() || it->second.withdrawn || followers(it->second) == 0) return false;
+    Entry& entry = it->second;
+    entry.transfer = entry.status;
+    entry.withdrawn = true;
+
+    bool was_finished = is_finished(entry.status.state);
+    entry.status.state = JobState::Cancelled;
+    entry.status.output.clear();
+    changed(entry, was_finished);
+    forget_finished();
+    return true;
+}
+
+bool JobTable::transfer(uint64_t id, JobStatus& out) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = jobs_.find(id);
+    if (it == jobs_.end()) return false;
+    out = it->second.withdrawn ? it->second.transfer : it->second.status;
+    return true;
+}
+
+size_t JobTable::sharing(uint64_t id) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = jobs_.find(id);
+    if (it == jobs_.end()) return 0;
+    return followers(it->second) + (it->second.withdrawn ? 0 : 1);
+}
+
+bool JobTable::abandoned(uint64_t id) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = jobs_.find(id);
+    return it != jobs_.end() && running(it->second) && followers(it->second) == 0;
+}
+
+// Followers still in the table (forgotten ones finished long ago)
+size_t JobTable::followers(const Entry& entry) const {
+    size_t count = 0;
+    for (uint64_t id : entry.followers) count += jobs_.count(id);
+    return count;
+}
+
+// A withdrawn job looks finished but may still be carrying a transfer
+bool JobTable::running(const Entry& entry) {
+    return entry.withdrawn && !is_finished(entry.transfer.state);
+}
+
+// Stamps the next version on a job that just changed
+void JobTable::changed(Entry& entry, bool was_finished) {
+    entry.status.version = ++version_;
+    by_version_.splice(by_version_.end(), by_version_, entry.position);
+    if (!was_finished && is_finished(entry.status.state)) finished_++;
+    else if (was_finished && !is_finished(entry.status.state)) finished_--;
+}
+
+// Finished jobs drift to the front as newer changes pile up behind them, so
+// this rarely looks past the first few entries
+void JobTable::forget_finished() {
+    for (auto it = by_version_.begin(); finished_ > max_finished_ && it != by_version_.end();) {
+        auto job = jobs_.find(*it);
+        if (!is_finished(job->second.status.state) || running(job->second)) {
+            ++it;
+            continue;
+        }
+        jobs_.erase(job);
+        it = by_version_.erase(it);
+        finished_--;
+    }
+}
+
+std::vector<JobStatus> JobTable::changed_since(uint64_t since, uint64_t& version) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    version = version_;
+
+    // Walk back from the newest change to the first one the caller has seen
+    auto first = by_version_.end();
+    size_t count = 0;
+    while (first != by_version_.begin()) {
+        auto previous = std::prev(first);
+        if (jobs_.at(*previous).status.version <= since) break;
+        first = previous;
+        count++;
+    }
+
+    std::vector<JobStatus> changed;
+    changed.reserve(count);
+    for (auto it = first; it != by_version_.end(); ++it) changed.push_back(jobs_.at(*it).status);
+    return changed;
+}
+
+// --- 2. Controls ---
+ControlStep control_step(JobControl control, JobState state, bool running, bool stashed) {
+    switch (control) {
+        case JobControl::Pause:
+            if (state == JobState::Queued) return ControlStep::MarkPaused;
+            if (running) return ControlStep::PauseDownload;
+            return state == JobState::Paused ? ControlStep::None : ControlStep::Refuse;
+        case JobControl::Resume:
+            if (stashed) return ControlStep::Requeue;
+            if (state == JobState::Paused) return ControlStep::MarkQueued;
+            if (running) return ControlStep::ResumeDownload;
+            return state == JobState::Queued ? ControlStep::None : ControlStep::Refuse;
+        case JobControl::Cancel:
+            if (state == JobState::Queued || state == JobState::Paused) return ControlStep::MarkCancelled;
+            if (running) return ControlStep::CancelDownload;
+            return state == JobState::Cancelled ? ControlStep::None : ControlStep::Refuse;
+    }
+    return ControlStep::Refuse;
+}
+
+// --- 3. Duplicates ---
+std::string url_key(const std::string& url) { return "url " + normalize_url(url); }
+
+std::string links_key(const std::vector<std::string>& links) {
+    std::string key = "links";
+    for (const std::string& link : links) key += " " + normalize_url(link);
+    return key;
+}
+
+std::string download_key(const std::string& url, const std::string& format) {
+    return format.empty() ? url_key(url) : url_key(url) + " " + format;
+}
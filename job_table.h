@@ -0,0 +1,130 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// --- Job Table ---
+// Every queued URL gets an id and an entry here that the web app's status
+// endpoints read. Lookups by id are a hash map hit. Every change stamps the
+// job with the next table version and moves it to the back of a list, so
+// "what changed since version V" walks only the jobs that did; a client
+// polling 10k jobs gets the handful that moved, not all of them.
+
+// Paused jobs keep their finished ranges on disk until they are resumed or
+// cancelled. Cancelled counts as finished.
+enum class JobState { Queued, Downloading, Paused, Done, Failed, Cancelled };
+
+const char* job_state_name(JobState state);
+
+struct JobStatus {
+    uint64_t id = 0;
+    std::string url;
+    JobState state = JobState::Queued;
+    long long downloaded = 0;
+    long long total = 0;  // 0 until known
+    std::string output;   // file name, once it has one
+    std::string error;    // why it failed
+    uint64_t version = 0; // table version of the last change
+    uint64_t same_as = 0; // the job whose transfer this one shares, if any
+};
+
+class JobTable {
+public:
+    // Finished jobs beyond this are forgotten, least recently changed first
+    explicit JobTable(size_t max_finished = 10000) : max_finished_(max_finished) {}
+
+    // Queued jobs with consecutive ids; returns the first
+    uint64_t add(const std::vector<std::string>& urls);
+
+    bool get(uint64_t id, JobStatus& out) const;
+
+    // Calls `change` on the job; it returns false if it left the job as it
+    // was, and the version stays put. False for unknown ids.
+    bool update(uint64_t id, const std::function<bool(JobStatus&)>& change);
+
+    // From now on `id` shows whatever happens to `to` (state, progress,
+    // output, error): it was a duplicate and shares `to`'s transfer. False
+    // if either is unknown or `to` follows another job itself.
+    bool attach(uint64_t id, uint64_t to);
+
+    // The job stops following and is on its own again; whoever cancels it
+    // marks it afterwards. Returns the job it followed, 0 if none.
+    uint64_t detach(uint64_t id);
+
+    // Cancelled by its submitter while other jobs still follow it: the job
+    // shows as cancelled, but the transfer carries on for the followers and
+    // update() changes what they show. False if nothing follows it.
+    bool withdraw(uint64_t id);
+
+    // The transfer `id` stands for: the job itself, or for a withdrawn job
+    // the state its followers still see. What to decide controls by.
+    bool transfer(uint64_t id, JobStatus& out) const;
+
+    // Jobs that show the transfer: the followers, plus `id` unless withdrawn
+    size_t sharing(uint64_t id) const;
+
+    // Withdrawn and nothing follows it anymore, but the transfer isn't over:
+    // nobody wants it, so it should be stopped
+    bool abandoned(uint64_t id) const;
+
+    // Jobs changed after version `since`, oldest change first. `version` is
+    // what to pass as `since` next time.
+    std::vector<JobStatus> changed_since(uint64_t since, uint64_t& version) const;
+
+private:
+    struct Entry {
+        JobStatus status;
+        std::list<uint64_t>::iterator position; // in by_version_
+        std::vector<uint64_t> followers;        // attached to this one
+        bool withdrawn = false;
+        JobStatus transfer;                     // while withdrawn, what followers see
+    };
+    void changed(Entry& entry, bool was_finished);
+    size_t followers(const Entry& entry) const;
+    static bool running(const Entry& entry);
+    void forget_finished();
+
+    size_t max_finished_;
+    mutable std::mutex mutex_;
+    std::unordered_map<uint64_t, Entry> jobs_;
+    std::list<uint64_t> by_version_; // ids, least recently changed first
+    uint64_t next_id_ = 1;
+    uint64_t version_ = 0;
+    size_t finished_ = 0;
+};
+
+// --- Job Controls ---
+// What pause, resume or cancel does to a transfer in `state`. `running`: the
+// worker has its download going; `stashed`: the worker set it aside paused
+// and waits for a resume. None means it is there already; Refuse, that the
+// transfer is past the point where the control makes sense.
+enum class JobControl { Pause, Resume, Cancel };
+enum class ControlStep {
+    None,
+    Refuse,
+    MarkPaused,     // still queued: the worker stashes it when it comes up
+    PauseDownload,
+    MarkQueued,     // paused before it ever left the queue
+    Requeue,        // stashed: back to the front of the line
+    ResumeDownload, // in case the pause hadn't landed yet
+    MarkCancelled,  // and a stashed download's part files go
+    CancelDownload,
+};
+
+ControlStep control_step(JobControl control, JobState state, bool running, bool stashed);
+
+// --- Duplicates ---
+// What two submissions of one download have in common, before and after
+// resolving: the page URL, or the direct links in order. Both go through
+// normalize_url(), so spellings of one URL make one key.
+std::string url_key(const std::string& url);
+std::string links_key(const std::vector<std::string>& links);
+
+// What the download cache files a single-file job under: the page URL and
+// format, since the direct links are signed and change with every resolve
+std::string download_key(const std::string& url, const std::string& format);
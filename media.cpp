@@ -0,0 +1,256 @@
+#include "media.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+
+extern char** environ;
+
+// --- 1. Splitting the Connections ---
+std::string stream_file_name(const std::string& output, int stream) {
+    size_t dot = output.find_last_of('.');
+    size_t slash = output.find_last_of('/');
+    std::string tag = ".f" + std::to_string(stream);
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) return output + tag;
+    return output.substr(0, dot) + tag + output.substr(dot);
+}
+
+std::vector<int> split_connections(int connections, const std::vector<long long>& sizes) {
+    std::vector<int> shares(sizes.size(), 1);
+    bool known = std::all_of(sizes.begin(), sizes.end(), [](long long size) { return size > 0; });
+
+    // One at a time to whichever stream has the most bytes per connection, so they finish together
+    for (int left = connections - (int)sizes.size(); left > 0; left--) {
+        size_t best = 0;
+        for (size_t i = 1; i < sizes.size(); i++) {
+            double mine = (known ? sizes[i] : 1.0) / shares[i];
+            double theirs = (known ? sizes[best] : 1.0) / shares[best];
+            if (mine > theirs) best = i;
+        }
+        shares[best]++;
+    }
+    return shares;
+}
+
+// --- 2. Muxing ---
+bool mux_streams(const std::vector<std::string>& inputs, const std::string& output, std::string& error) {
+    std::vector<std::string> args = {"ffmpeg", "-nostdin", "-y", "-loglevel", "error"};
+    for (const std::string& input : inputs) {
+        args.push_back("-i");
+        args.push_back(input);
+    }
+    for (size_t i = 0; i < inputs.size(); i++) {
+        args.push_back("-map");
+        args.push_back(std::to_string(i));
+    }
+    args.push_back("-c");
+    args.push_back("copy");
+    args.push_back(output);
+
+    remove(output.c_str()); // -y would write through a hard link into the download cache
+
+    int err[2];
+    if (pipe2(err, O_CLOEXEC) < 0) {
+        error = "pipe() failed";
+        return false;
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, err[1], STDERR_FILENO);
+
+    std::vector<char*> argv;
+    for (const std::string& arg : args) argv.push_back((char*)arg.c_str());
+    argv.push_back(nullptr);
+
+    pid_t pid;
+    int failed = posix_spawnp(&pid, "ffmpeg", &actions, nullptr, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(err[1]);
+    if (failed) {
+        close(err[0]);
+        error = "ffmpeg is not installed";
+        return false;
+    }
+
+    std::string messages;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(err[0], buffer, sizeof(buffer))) > 0) messages.append(buffer, n);
+    close(err[0]);
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) return true;
+
+    // ffmpeg's last line says what went wrong
+    while (!messages.empty() && messages.back() == '\n') messages.pop_back();
+    error = "ffmpeg failed: " + messages.substr(messages.find_last_of('\n') + 1);
+    return false;
+}
+
+// --- 3. The Media Download ---
+MediaDownload::MediaDownload(DownloadOptions options, std::vector<std::string> links,
+                             std::vector<std::shared_ptr<const ProbeResult>> probes)
+    : options_(std::move(options)), links_(std::move(links)), probes_(std::move(probes)) {
+    probes_.resize(links_.size());
+}
+
+DownloadResult MediaDownload::run() {
+    finished_ = false;
+    std::vector<long long> sizes;
+    for (const auto& probe : probes_) sizes.push_back(probe ? probe->info.size : -1);
+    std::vector<int> shares = split_connections(options_.num_threads, sizes);
+
+    std::vector<DownloadOptions> stream_options;
+    for (size_t i = 0; i < links_.size(); i++) {
+        DownloadOptions options = options_;
+        options.url = links_[i];
+        options.probed = probes_[i];
+        options.num_threads = shares[i];
+        if (links_.size() > 1) {
+            options.previous = nullptr; // a copy of the muxed file is no copy of a stream
+            options.output = stream_file_name(options_.output, i);
+            if (!options.trace_path.empty()) options.trace_path = stream_file_name(options_.trace_path, i);
+        }
+        stream_options.push_back(options);
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (streams_.empty()) {
+            for (const DownloadOptions& options : stream_options) {
+                streams_.push_back(std::make_unique<Download>(options));
+                if (pause_requested_) streams_.back()->pause();
+                if (cancel_requested_) streams_.back()->cancel();
+            }
+            results_.resize(streams_.size());
+        }
+    }
+
+    // Every stream still to do but the first gets a thread of its own
+    auto started = std::chrono::steady_clock::now();
+    std::vector<size_t> todo;
+    for (size_t i = 0; i < streams_.size(); i++) {
+        if (!results_[i].ok) todo.push_back(i);
+    }
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < todo.size(); t++) {
+        threads.emplace_back([this, i = todo[t]] { results_[i] = streams_[i]->run(); });
+    }
+    if (!todo.empty()) results_[todo[0]] = streams_[todo[0]]->run();
+    for (std::thread& thread : threads) thread.join();
+
+    DownloadResult result;
+    result.ok = !results_.empty();
+    result.unchanged = result.ok;
+    if (!result.ok) result.error = "Nothing to download";
+    bool failed = false;
+    for (const DownloadResult& stream : results_) {
+        result.bytes += stream.bytes;
+        result.retries += stream.retries;
+        result.restarts += stream.restarts;
+        result.http3 = result.http3 || stream.http3;
+        result.paused = result.paused || stream.paused;
+        result.cancelled = result.cancelled || stream.cancelled;
+        result.unchanged = result.unchanged && stream.unchanged;
+        failed = failed || (!stream.ok && !stream.paused && !stream.cancelled);
+        if (stream.first_byte > 0 && (result.first_byte == 0 || stream.first_byte < result.first_byte)) {
+            result.first_byte = stream.first_byte;
+        }
+        if (!stream.ok && result.ok) {
+            result.ok = false;
+            result.error = stream.error;
+        }
+    }
+    if (!results_.empty()) result.mode = results_[0].mode;
+
+    if (result.paused && (failed || result.cancelled)) {
+        // Nothing left to resume for: let the paused streams clean up after themselves
+        for (size_t i = 0; i < streams_.size(); i++) {
+            if (!results_[i].paused) continue;
+            streams_[i]->cancel();
+            results_[i] = streams_[i]->run();
+        }
+        result.paused = false;
+    }
+
+    if (streams_.size() > 1 && !result.paused) {
+        std::vector<std::string> inputs;
+        for (const DownloadOptions& options : stream_options) inputs.push_back(options.output);
+        if (result.ok && !mux_streams(inputs, options_.output, result.error)) {
+            // Keep the streams: they are the whole download, just not in one file yet
+            result.ok = false;
+            result.error += " (the streams are left in";
+            for (const std::string& input : inputs) result.error += " " + input;
+            result.error += ")";
+        } else {
+            // Muxed, or one of them failed and the rest are no use on their own
+            for (const std::string& input : inputs) remove(input.c_str());
+        }
+    }
+
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    finished_ = true;
+    return result;
+}
+
+std::vector<RemoteInfo> MediaDownload::sources() const {
+    std::vector<RemoteInfo> sources;
+    for (const DownloadResult& result : results_) sources.push_back(result.remote);
+    return sources;
+}
+
+void MediaDownload::pause() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pause_requested_ = true;
+    for (const auto& stream : streams_) stream->pause();
+}
+
+void MediaDownload::resume() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pause_requested_ = false;
+    for (const auto& stream : streams_) stream->resume();
+}
+
+void MediaDownload::cancel() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cancel_requested_ = true;
+    for (const auto& stream : streams_) stream->cancel();
+}
+
+long long MediaDownload::total_size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    long long total = 0;
+    for (const auto& stream : streams_) {
+        // Half the picture would make the progress jump backwards later
+        if (stream->total_size() <= 0) return 0;
+        total += stream->total_size();
+    }
+    return total;
+}
+
+long long MediaDownload::downloaded() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    long long total = 0;
+    for (const auto& stream : streams_) total += stream->downloaded();
+    return total;
+}
+
+std::vector<SegmentProgress> MediaDownload::progress() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<SegmentProgress> all;
+    for (const auto& stream : streams_) {
+        int first_id = all.size();
+        for (SegmentProgress segment : stream->progress()) {
+            segment.id += first_id;
+            all.push_back(segment);
+        }
+    }
+    return all;
+}
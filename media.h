@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "downloader.h"
+
+// --- Media Downloads ---
+// The best qualities come as separate video and audio streams (DASH). Both
+// are fetched at the same time, splitting one connection budget
+// (options.num_threads) in proportion to their sizes so they finish
+// together, and ffmpeg then copies them into one file without re-encoding.
+// The job takes as long as the bigger stream instead of the two in a row.
+//
+// With a single link this is just a Download.
+
+class MediaDownload {
+public:
+    // One link per stream, video first. `probes` (optional, one per link,
+    // entries may be null) come from a ResolveStage and set the split.
+    MediaDownload(DownloadOptions options, std::vector<std::string> links,
+                  std::vector<std::shared_ptr<const ProbeResult>> probes = {});
+    MediaDownload(const MediaDownload&) = delete;
+    MediaDownload& operator=(const MediaDownload&) = delete;
+
+    // Blocks until options.output is on disk (or we gave up). The result
+    // adds up the streams. After a pause, resume() and run() again: streams
+    // that had finished stay finished, the others carry on.
+    DownloadResult run();
+
+    // Like Download's: for every stream, from any thread
+    void pause();
+    void resume();
+    void cancel();
+
+    // Safe to call from another thread while run() is going. Segments of
+    // all streams, numbered one after the other.
+    long long total_size() const;
+    long long downloaded() const;
+    bool finished() const { return finished_.load(); }
+    std::vector<SegmentProgress> progress() const;
+
+    // Per stream, what its server said about the version that was fetched.
+    // For after run(), from the same thread.
+    std::vector<RemoteInfo> sources() const;
+
+private:
+    DownloadOptions options_;
+    std::vector<std::string> links_;
+    std::vector<std::shared_ptr<const ProbeResult>> probes_;
+    mutable std::mutex mutex_; // held while streams_ is filled, and by pause() and co.
+    std::vector<std::unique_ptr<Download>> streams_;
+    std::vector<DownloadResult> results_; // each stream's last run
+    bool pause_requested_ = false;        // for streams that don't exist yet
+    bool cancel_requested_ = false;
+    std::atomic<bool> finished_{false};
+};
+
+// "video.mp4" -> "video.f1.mp4", where stream 1 waits to be muxed
+std::string stream_file_name(const std::string& output, int stream);
+
+// Splits `connections` over streams of these sizes (<= 0 = unknown), at
+// least one each. Unknown sizes get an even share.
+std::vector<int> split_connections(int connections, const std::vector<long long>& sizes);
+
+// ffmpeg -i each input, stream copy into `output`. False with ffmpeg's
+// message in `error` when that fails.
+bool mux_streams(const std::vector<std::string>& inputs, const std::string& output, std::string& error);
@@ -0,0 +1,257 @@
+#include "metrics.h"
+#include "buffer_pool.h"
+
+#include <atomic>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+// --- 1. Histogram Buckets ---
+static const double WRITE_LATENCY_BUCKETS[] = {
+    0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 1.0,
+};
+constexpr int WRITE_LATENCY_BUCKET_COUNT = sizeof(WRITE_LATENCY_BUCKETS) / sizeof(double);
+
+static const double THROUGHPUT_BUCKETS[] = {
+    64e3, 256e3, 1e6, 4e6, 16e6, 64e6, 256e6, 1e9,
+};
+constexpr int THROUGHPUT_BUCKET_COUNT = sizeof(THROUGHPUT_BUCKETS) / sizeof(double);
+
+// --- 2. Per-Thread Shards ---
+// Only the owning thread writes a shard, so a relaxed load + store is enough
+// (no locked read-modify-write). The scraper only reads.
+struct MetricsShard {
+    std::atomic<long long> counters[(int)MetricCounter::Count_] = {};
+    std::atomic<long long> write_buckets[WRITE_LATENCY_BUCKET_COUNT + 1] = {};
+    std::atomic<long long> write_count{0};
+    std::atomic<double> write_sum{0};
+};
+
+static void bump(std::atomic<long long>& value, long long n) {
+    value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+struct Histogram {
+    std::vector<long long> buckets; // last one is +Inf
+    long long count = 0;
+    double sum = 0;
+};
+
+struct MetricsRegistry {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<MetricsShard>> shards;
+    std::vector<MetricsShard*> free_shards; // from threads that have exited
+
+    std::atomic<long long> gauges[(int)MetricGauge::Count_] = {};
+    std::map<std::string, Histogram> host_throughput;
+    std::map<std::pair<std::string, std::string>, double> edge_throughput;
+    std::map<std::string, double> source_throughput;
+
+    // Threads come and go with every segment, so shards get recycled. Their
+    // totals stay in place; the next thread simply keeps adding to them.
+    MetricsShard* take_shard() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!free_shards.empty()) {
+            MetricsShard* shard = free_shards.back();
+            free_shards.pop_back();
+            return shard;
+        }
+        shards.push_back(std::make_unique<MetricsShard>());
+        free_shards.reserve(shards.size());
+        return shards.back().get();
+    }
+
+    void give_back(MetricsShard* shard) {
+        std::lock_guard<std::mutex> lock(mutex);
+        free_shards.push_back(shard);
+    }
+};
+
+static MetricsRegistry& registry() {
+    static MetricsRegistry* instance = new MetricsRegistry; // outlives every thread_local
+    return *instance;
+}
+
+struct ShardHandle {
+    MetricsShard* shard = registry().take_shard();
+    ~ShardHandle() { registry().give_back(shard); }
+};
+
+static MetricsShard& my_shard() {
+    thread_local ShardHandle handle;
+    return *handle.shard;
+}
+
+// --- 3. Recording ---
+void metrics_add(MetricCounter counter, long long n) {
+    bump(my_shard().counters[(int)counter], n);
+}
+
+void metrics_observe_write_latency(double seconds) {
+    MetricsShard& shard = my_shard();
+    int bucket = 0;
+    while (bucket < WRITE_LATENCY_BUCKET_COUNT && seconds > WRITE_LATENCY_BUCKETS[bucket]) bucket++;
+    bump(shard.write_buckets[bucket], 1);
+    bump(shard.write_count, 1);
+    shard.write_sum.store(shard.write_sum.load(std::memory_order_relaxed) + seconds, std::memory_order_relaxed);
+}
+
+void metrics_gauge_add(MetricGauge gauge, long long delta) {
+    registry().gauges[(int)gauge].fetch_add(delta, std::memory_order_relaxed);
+}
+
+void metrics_gauge_set(MetricGauge gauge, long long value) {
+    registry().gauges[(int)gauge].store(value, std::memory_order_relaxed);
+}
+
+void metrics_observe_host_throughput(const std::string& host, double bytes_per_second) {
+    MetricsRegistry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    Histogram& histogram = r.host_throughput[host];
+    if (histogram.buckets.empty()) histogram.buckets.resize(THROUGHPUT_BUCKET_COUNT + 1);
+
+    int bucket = 0;
+    while (bucket < THROUGHPUT_BUCKET_COUNT && bytes_per_second > THROUGHPUT_BUCKETS[bucket]) bucket++;
+    histogram.buckets[bucket]++;
+    histogram.count++;
+    histogram.sum += bytes_per_second;
+}
+
+void metrics_set_edge_throughput(const std::string& host, const std::string& address, double bytes_per_second) {
+    MetricsRegistry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.edge_throughput[{host, address}] = bytes_per_second;
+}
+
+void metrics_set_source_throughput(const std::string& source, double bytes_per_second) {
+    MetricsRegistry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.source_throughput[source] = bytes_per_second;
+}
+
+// --- 4. Prometheus Text Format ---
+static std::string escape_label(const std::string& value) {
+    std::string out;
+    for (char c : value) {
+        if (c == '\\' || c == '"') out += '\\';
+        if (c == '\n') out += "\\n";
+        else out += c;
+    }
+    return out;
+}
+
+static std::string format_number(double value) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%.9g", value);
+    return buffer;
+}
+
+static void write_header(std::ostringstream& out, const char* name, const char* type, const char* help) {
+    out << "# HELP " << name << " " << help << "\n";
+    out << "# TYPE " << name << " " << type << "\n";
+}
+
+static void write_histogram(std::ostringstream& out, const char* name, const std::string& labels,
+                            const double* bounds, int bound_count, const Histogram& histogram) {
+    std::string prefix = labels.empty() ? "" : labels + ",";
+    long long cumulative = 0;
+    for (int i = 0; i < bound_count; i++) {
+        cumulative += histogram.buckets[i];
+        out << name << "_bucket{" << prefix << "le=\"" << format_number(bounds[i]) << "\"} " << cumulative << "\n";
+    }
+    cumulative += histogram.buckets[bound_count];
+    out << name << "_bucket{" << prefix << "le=\"+Inf\"} " << cumulative << "\n";
+
+    std::string suffix = labels.empty() ? "" : "{" + labels + "}";
+    out << name << "_sum" << suffix << " " << format_number(histogram.sum) << "\n";
+    out << name << "_count" << suffix << " " << histogram.count << "\n";
+}
+
+std::string metrics_render() {
+    MetricsRegistry& r = registry();
+    long long counters[(int)MetricCounter::Count_] = {};
+    Histogram write_latency;
+    write_latency.buckets.resize(WRITE_LATENCY_BUCKET_COUNT + 1);
+    std::map<std::string, Histogram> host_throughput;
+    std::map<std::pair<std::string, std::string>, double> edge_throughput;
+    std::map<std::string, double> source_throughput;
+
+    {
+        std::lock_guard<std::mutex> lock(r.mutex);
+        for (auto& shard : r.shards) {
+            for (int i = 0; i < (int)MetricCounter::Count_; i++) {
+                counters[i] += shard->counters[i].load(std::memory_order_relaxed);
+            }
+            for (int i = 0; i <= WRITE_LATENCY_BUCKET_COUNT; i++) {
+                write_latency.buckets[i] += shard->write_buckets[i].load(std::memory_order_relaxed);
+            }
+            write_latency.count += shard->write_count.load(std::memory_order_relaxed);
+            write_latency.sum += shard->write_sum.load(std::memory_order_relaxed);
+        }
+        host_throughput = r.host_throughput;
+        edge_throughput = r.edge_throughput;
+        source_throughput = r.source_throughput;
+    }
+
+    std::ostringstream out;
+    auto counter = [&](const char* name, const char* help, MetricCounter which) {
+        write_header(out, name, "counter", help);
+        out << name << " " << counters[(int)which] << "\n";
+    };
+    auto gauge = [&](const char* name, const char* help, MetricGauge which) {
+        write_header(out, name, "gauge", help);
+        out << name << " " << r.gauges[(int)which].load(std::memory_order_relaxed) << "\n";
+    };
+
+    counter("downloader_bytes_received_total", "Body bytes received from servers.", MetricCounter::BytesReceived);
+    counter("downloader_bytes_written_total", "Bytes written to disk by the writer stage.", MetricCounter::BytesWritten);
+    counter("downloader_retries_total", "Segment requests retried after a failure.", MetricCounter::Retries);
+    counter("downloader_restarts_total", "Downloads restarted because the file changed.", MetricCounter::Restarts);
+    counter("downloader_segments_started_total", "Segments handed to a connection.", MetricCounter::SegmentsStarted);
+
+    write_header(out, "downloader_jobs_total", "counter", "Finished jobs by outcome.");
+    out << "downloader_jobs_total{result=\"ok\"} " << counters[(int)MetricCounter::JobsSucceeded] << "\n";
+    out << "downloader_jobs_total{result=\"failed\"} " << counters[(int)MetricCounter::JobsFailed] << "\n";
+
+    write_header(out, "downloader_cache_lookups_total", "counter", "Download cache lookups by outcome.");
+    out << "downloader_cache_lookups_total{result=\"hit\"} " << counters[(int)MetricCounter::CacheHits] << "\n";
+    out << "downloader_cache_lookups_total{result=\"miss\"} " << counters[(int)MetricCounter::CacheMisses] << "\n";
+
+    write_header(out, "downloader_backpressure_events_total", "counter",
+                 "Times a download thread waited for the writer to hand buffers back.");
+    out << "downloader_backpressure_events_total " << recv_buffer_pool().backpressure_events() << "\n";
+
+    gauge("downloader_active_connections", "Segment transfers in flight.", MetricGauge::ActiveConnections);
+    gauge("downloader_active_downloads", "Jobs currently downloading.", MetricGauge::ActiveDownloads);
+    gauge("downloader_queue_depth", "Jobs waiting in the queue.", MetricGauge::QueueDepth);
+
+    write_header(out, "downloader_disk_write_seconds", "histogram", "Time to write one receive buffer to disk.");
+    write_histogram(out, "downloader_disk_write_seconds", "", WRITE_LATENCY_BUCKETS, WRITE_LATENCY_BUCKET_COUNT,
+                    write_latency);
+
+    write_header(out, "downloader_host_throughput_bytes_per_second", "histogram",
+                 "Throughput of finished segment transfers, per host.");
+    for (const auto& [host, histogram] : host_throughput) {
+        write_histogram(out, "downloader_host_throughput_bytes_per_second", "host=\"" + escape_label(host) + "\"",
+                        THROUGHPUT_BUCKETS, THROUGHPUT_BUCKET_COUNT, histogram);
+    }
+
+    write_header(out, "downloader_edge_throughput_bytes_per_second", "gauge",
+                 "Smoothed per-connection throughput of each address a host resolved to.");
+    for (const auto& [edge, speed] : edge_throughput) {
+        out << "downloader_edge_throughput_bytes_per_second{host=\"" << escape_label(edge.first) << "\",address=\""
+            << escape_label(edge.second) << "\"} " << format_number(speed) << "\n";
+    }
+
+    write_header(out, "downloader_source_throughput_bytes_per_second", "gauge",
+                 "Smoothed per-connection throughput of each local interface segments went out on.");
+    for (const auto& [source, speed] : source_throughput) {
+        out << "downloader_source_throughput_bytes_per_second{source=\"" << escape_label(source) << "\"} "
+            << format_number(speed) << "\n";
+    }
+
+    return out.str();
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <string>
+
+// --- Metrics ---
+// Counters the download threads bump on every callback live in per-thread
+// shards: each thread only ever writes its own shard, with plain relaxed
+// atomics and no locks. A scrape walks all shards and adds them up, so
+// reading /metrics never makes a download thread wait.
+//
+// Things that happen once per segment or per job (throughput samples, gauges)
+// are rare enough to go through a mutex.
+
+enum class MetricCounter {
+    BytesReceived,
+    BytesWritten,
+    Retries,
+    Restarts,
+    SegmentsStarted,
+    JobsSucceeded,
+    JobsFailed,
+    CacheHits,   // download cache lookups that put a file in place
+    CacheMisses, // ... that found nothing, or nothing current
+    Count_ // keep last
+};
+
+enum class MetricGauge {
+    ActiveConnections,
+    ActiveDownloads,
+    QueueDepth,
+    Count_ // keep last
+};
+
+// Hot path: lock-free, touches only the calling thread's shard
+void metrics_add(MetricCounter counter, long long n = 1);
+void metrics_observe_write_latency(double seconds);
+
+// Cold path
+void metrics_gauge_add(MetricGauge gauge, long long delta);
+void metrics_gauge_set(MetricGauge gauge, long long value);
+void metrics_observe_host_throughput(const std::string& host, double bytes_per_second);
+void metrics_set_edge_throughput(const std::string& host, const std::string& address, double bytes_per_second);
+void metrics_set_source_throughput(const std::string& source, double bytes_per_second);
+
+// Everything above in the Prometheus text exposition format
+std::string metrics_render();
@@ -0,0 +1,61 @@
+#!/usr/bin/env bash
+# --- Profile-Guided Optimization ---
+# Trains the engine on the local range server and rebuilds everything with
+# the profiles:
+#
+#   1. build/lto           the baseline: Release + LTO
+#   2. build/pgo-generate  instrumented; range_bench runs the training workload
+#   3. build/pgo-use       Release + LTO + the profiles (webapp, my_downloader, ...)
+#   4. the same benchmark on 1 and 3, side by side
+#
+# The workload is what the web app sees: lots of small files (fetched whole
+# by the probe) plus a few multi-GB files split over segments and streams.
+# Override the sizes for a quicker run:
+#
+#   PGO_SMALL_FILES=500 PGO_LARGE_MB=256 ./pgo.sh
+set -euo pipefail
+cd "$(dirname "$0")"
+
+SMALL_FILES=${PGO_SMALL_FILES:-3000} # x 64 KB
+LARGE_FILES=${PGO_LARGE_FILES:-2}
+LARGE_MB=${PGO_LARGE_MB:-2048}
+REPEAT=${PGO_REPEAT:-3}              # benchmark runs per workload, averaged
+JOBS=${PGO_JOBS:-$(nproc)}
+
+build() {
+    cmake --preset "$1" >/dev/null
+    cmake --build "build/$1" -j"$JOBS"
+}
+
+# One line per workload and engine mode: "<workload> <mode> <MB/s> <CPU s/GB>", averaged over the runs
+workload() {
+    local bench=$1 repeat=$2
+    "$bench" --size-kb 64 --files "$SMALL_FILES" --modes segmented --repeat "$repeat" |
+        awk '$NF == "yes" || $NF == "NO"' | sed 's/^/small /'
+    "$bench" --size "$LARGE_MB" --files "$LARGE_FILES" --modes segmented,multiplexed --repeat "$repeat" |
+        awk '$NF == "yes" || $NF == "NO"' | sed 's/^/large /'
+}
+
+average() {
+    awk '{ key = $1 " " $2; mbs[key] += $3; cpu[key] += $5; runs[key]++ }
+         END { for (key in runs) printf "%s %.1f %.3f\n", key, mbs[key] / runs[key], cpu[key] / runs[key] }' | sort
+}
+
+echo "== Baseline (lto)"
+build lto
+
+echo "== Training (pgo-generate)"
+rm -rf pgo-profiles
+build pgo-generate
+workload build/pgo-generate/range_bench 1 >/dev/null || { echo "training run failed" >&2; exit 1; }
+
+echo "== Optimized (pgo-use)"
+build pgo-use
+
+echo "== Benchmark: $SMALL_FILES x 64 KB, $LARGE_FILES x $LARGE_MB MB, $REPEAT runs each"
+before=$(workload build/lto/range_bench "$REPEAT" | average) || { echo "baseline run failed" >&2; exit 1; }
+after=$(workload build/pgo-use/range_bench "$REPEAT" | average) || { echo "optimized run failed" >&2; exit 1; }
+
+printf "%-8s %-14s %12s %12s %12s %12s\n" workload mode "MB/s before" "MB/s after" "CPU/GB before" "CPU/GB after"
+join -j1 <(echo "$before" | awk '{ print $1 "/" $2, $3, $4 }') <(echo "$after" | awk '{ print $1 "/" $2, $3, $4 }') |
+    awk '{ split($1, key, "/"); printf "%-8s %-14s %12.1f %12.1f %12.3f %12.3f\n", key[1], key[2], $2, $4, $3, $5 }'
@@ -0,0 +1,53 @@
+#include "piece_manifest.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <sstream>
+#include "sha256.h"
+
+bool parse_piece_manifest(const std::string& text, PieceManifest& manifest) {
+    std::istringstream in(text);
+    std::string key;
+    manifest = PieceManifest();
+    if (!(in >> key >> manifest.piece_size) || key != "piece-size" || manifest.piece_size <= 0) return false;
+    if (!(in >> key >> manifest.size) || key != "size" || manifest.size < 0) return false;
+    for (std::string hash; in >> hash;) {
+        if (hash.size() != 64 || hash.find_first_not_of("0123456789abcdef") != std::string::npos) return false;
+        manifest.hashes.push_back(hash);
+    }
+    long long pieces = (manifest.size + manifest.piece_size - 1) / manifest.piece_size;
+    return (long long)manifest.hashes.size() == pieces;
+}
+
+std::string render_piece_manifest(const PieceManifest& manifest) {
+    std::string out = "piece-size " + std::to_string(manifest.piece_size) + "\nsize " +
+                      std::to_string(manifest.size) + "\n";
+    for (const std::string& hash : manifest.hashes) out += hash + "\n";
+    return out;
+}
+
+std::vector<std::string> piece_hashes(const std::string& path, long long piece_size) {
+    std::vector<std::string> hashes;
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file || piece_size <= 0) {
+        if (file) fclose(file);
+        return hashes;
+    }
+    std::vector<char> buffer(std::min<long long>(piece_size, 1 << 20));
+    while (true) {
+        Sha256 hash;
+        long long left = piece_size, got = 0;
+        size_t n = 0;
+        while (left > 0 && (n = fread(buffer.data(), 1, std::min<long long>(left, buffer.size()), file)) > 0) {
+            hash.update(buffer.data(), n);
+            left -= n;
+            got += n;
+        }
+        if (got > 0) hashes.push_back(hash.hex());
+        if (left > 0) break; // end of the file (or an error)
+    }
+    bool ok = !ferror(file);
+    fclose(file);
+    if (!ok) hashes.clear();
+    return hashes;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// --- Piece Manifests ---
+// A file's SHA-256 per fixed-size piece, published next to it so a client
+// holding an older version can fetch just the pieces that changed. Text:
+//
+//   piece-size 1048576
+//   size 3145851
+//   <sha256 of piece 0>
+//   <sha256 of piece 1>
+//   ...
+//
+// The last piece may be shorter than the rest.
+
+struct PieceManifest {
+    long long piece_size = 0;
+    long long size = 0;
+    std::vector<std::string> hashes; // lowercase hex, one per piece
+};
+
+// False unless the text is a manifest whose hashes cover `size` exactly
+bool parse_piece_manifest(const std::string& text, PieceManifest& manifest);
+std::string render_piece_manifest(const PieceManifest& manifest);
+
+// `path` cut into `piece_size` pieces and hashed. A short last piece is
+// hashed as it is. Empty if the file can't be read.
+std::vector<std::string> piece_hashes(const std::string& path, long long piece_size);
@@ -0,0 +1,240 @@
+#include <algorithm>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+#include "downloader.h"
+#include "range_server.h"
+
+// --- Range Benchmark ---
+// Downloads synthetic files from a local RangeServer with every engine mode and
+// prints throughput, time to first byte and CPU cost. The server runs in a
+// forked child so its CPU time doesn't end up in our numbers.
+//
+//   ./range_bench --size 256 --bandwidth 4096 --latency 20 --jitter 10 --drop-rate 0.02
+
+struct BenchConfig {
+    long long file_size = 256 * 1024 * 1024;
+    long long small_file_limit = -1; // -1 = the engine's default
+    int files = 1;
+    int threads = 4;
+    int repeat = 3;
+    bool verify = false;
+    bool http3 = false;
+    std::vector<std::string> interfaces;
+    int connections = 1;
+    std::string modes = "single,segmented,multiplexed";
+    std::string trace_dir;
+    RangeServerConfig server;
+};
+
+static void usage() {
+    std::cout << "Usage: range_bench [options]\n"
+              << "  --size MB          size of each synthetic file (default 256)\n"
+              << "  --size-kb KB       the same in KB, for many-small-files runs\n"
+              << "  --small-limit KB   files up to this size are fetched whole by the probe (0 = HEAD probe)\n"
+              << "  --files N          files per run (default 1)\n"
+              << "  --threads N        connections for segmented modes (default 4)\n"
+              << "  --connections N    connections multiplexed mode shares its streams over (default 1)\n"
+              << "  --repeat N         runs per mode (default 3)\n"
+              << "  --modes a,b        engine modes to compare (default single,segmented,multiplexed;\n"
+              << "                     auto is also accepted)\n"
+              << "  --bandwidth KB/s   per-connection bandwidth cap (default unlimited)\n"
+              << "  --latency MS       delay before each response\n"
+              << "  --jitter MS        extra random delay per response\n"
+              << "  --drop-rate P      chance a response gets cut off mid-body\n"
+              << "  --seed N           seed for jitter and drops\n"
+              << "  --verify           compare every byte against the server's content\n"
+              << "  --http3            let the engine use HTTP/3 where a server advertises it\n"
+              << "  --interfaces a,b   local interfaces or source IPs to spread segments over\n"
+              << "                     (127.0.0.2 etc. work without any setup)\n"
+              << "  --trace DIR        write a Chrome trace of every download into DIR\n";
+}
+
+static bool parse_args(int argc, char* argv[], BenchConfig& config) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        auto next = [&](std::string& value) {
+            if (i + 1 >= argc) return false;
+            value = argv[++i];
+            return true;
+        };
+        std::string value;
+        if (arg == "--verify") config.verify = true;
+        else if (arg == "--http3") config.http3 = true;
+        else if (arg == "--help") return false;
+        else if (!next(value)) return false;
+        else if (arg == "--size") config.file_size = std::stoll(value) * 1024 * 1024;
+        else if (arg == "--size-kb") config.file_size = std::stoll(value) * 1024;
+        else if (arg == "--small-limit") config.small_file_limit = std::stoll(value) * 1024;
+        else if (arg == "--files") config.files = std::stoi(value);
+        else if (arg == "--threads") config.threads = std::stoi(value);
+        else if (arg == "--connections") config.connections = std::stoi(value);
+        else if (arg == "--repeat") config.repeat = std::stoi(value);
+        else if (arg == "--modes") config.modes = value;
+        else if (arg == "--bandwidth") config.server.bandwidth = std::stoll(value) * 1024;
+        else if (arg == "--latency") config.server.latency_ms = std::stoi(value);
+        else if (arg == "--jitter") config.server.jitter_ms = std::stoi(value);
+        else if (arg == "--drop-rate") config.server.drop_rate = std::stod(value);
+        else if (arg == "--seed") config.server.seed = std::stoul(value);
+        else if (arg == "--trace") config.trace_dir = value;
+        else if (arg == "--interfaces") {
+            std::stringstream list(value);
+            for (std::string name; std::getline(list, name, ',');) config.interfaces.push_back(name);
+        }
+        else return false;
+    }
+    return true;
+}
+
+static std::string file_name(int i) { return "bench_" + std::to_string(i) + ".bin"; }
+
+// --- The Server Process ---
+// Returns the child's pid and fills in the port it is listening on
+static pid_t spawn_server(const BenchConfig& config, int& port) {
+    int fds[2];
+    if (pipe(fds) != 0) return -1;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        RangeServer server(config.server);
+        for (int i = 0; i < config.files; i++) server.add_file(file_name(i), config.file_size);
+        int bound = server.start();
+        if (write(fds[1], &bound, sizeof(bound)) != sizeof(bound)) _exit(1);
+        close(fds[1]);
+        pause(); // serve until the parent kills us
+        _exit(0);
+    }
+
+    close(fds[1]);
+    if (read(fds[0], &port, sizeof(port)) != sizeof(port)) port = -1;
+    close(fds[0]);
+    return pid;
+}
+
+static double cpu_seconds() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static bool verify_file(const std::string& path, const std::string& name, long long size) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) return false;
+    std::vector<char> got(1 << 20), want(1 << 20);
+    long long offset = 0;
+    bool same = true;
+    while (same) {
+        size_t n = fread(got.data(), 1, got.size(), f);
+        if (n == 0) break;
+        RangeServer::fill(name, offset, want.data(), n);
+        same = std::equal(got.begin(), got.begin() + n, want.begin());
+        offset += n;
+    }
+    fclose(f);
+    return same && offset == size;
+}
+
+int main(int argc, char* argv[]) {
+    BenchConfig config;
+    if (!parse_args(argc, argv, config)) {
+        usage();
+        return 1;
+    }
+
+    std::vector<EngineMode> modes;
+    std::stringstream mode_list(config.modes);
+    for (std::string name; std::getline(mode_list, name, ',');) {
+        EngineMode mode;
+        if (!parse_engine_mode(name, mode)) {
+            std::cerr << "Unknown mode: " << name << std::endl;
+            return 1;
+        }
+        modes.push_back(mode);
+    }
+
+    // Fork before we start any threads of our own
+    int port = -1;
+    pid_t server = spawn_server(config, port);
+    if (server < 0 || port < 0) {
+        std::cerr << "Could not start the local range server" << std::endl;
+        return 1;
+    }
+
+    char dir_template[] = "/tmp/range_bench_XXXXXX";
+    std::string dir = mkdtemp(dir_template);
+    long long file_size = config.file_size;
+    std::string base_url = "http://127.0.0.1:" + std::to_string(port) + "/";
+
+    if (config.http3 && !http3_supported()) {
+        std::cout << "This libcurl has no HTTP/3, every run will use TCP\n";
+    }
+    std::cout << "Serving " << config.files << " x " << file_size / 1024 << "KB on port " << port << "\n\n";
+    std::cout << std::left << std::setw(18) << "mode" << std::right
+              << std::setw(12) << "MB/s" << std::setw(12) << "TTFB ms"
+              << std::setw(12) << "CPU s/GB" << std::setw(10) << "retries" << std::setw(8) << "ok" << "\n";
+
+    bool all_ok = true;
+    for (EngineMode mode : modes) {
+        for (int run = 0; run < config.repeat; run++) {
+            double cpu = 0, seconds = 0, first_byte = 0;
+            long long bytes = 0;
+            int retries = 0;
+            bool ok = true;
+            std::string label = engine_mode_name(mode);
+
+            for (int i = 0; i < config.files; i++) {
+                DownloadOptions options;
+                options.url = base_url + file_name(i);
+                options.output = dir + "/" + file_name(i);
+                options.mode = mode;
+                options.num_threads = config.threads;
+                options.multiplex_connections = config.connections;
+                options.http3 = config.http3;
+                options.interfaces = config.interfaces;
+                if (config.small_file_limit >= 0) options.small_file_limit = config.small_file_limit;
+                if (!config.trace_dir.empty()) {
+                    options.trace_path = config.trace_dir + "/" + engine_mode_name(mode) + "_" +
+                                         std::to_string(run) + "_" + std::to_string(i) + ".json";
+                }
+
+                double cpu_before = cpu_seconds();
+                Download download(options);
+                DownloadResult result = download.run();
+                cpu += cpu_seconds() - cpu_before;
+                seconds += result.seconds;
+                first_byte += result.first_byte;
+                bytes += result.bytes;
+                retries += result.retries;
+                ok = ok && result.ok;
+                if (mode == EngineMode::Auto) label = std::string("auto/") + engine_mode_name(result.mode);
+                if (result.http3 && label.find("+h3") == std::string::npos) label += "+h3";
+                if (ok && config.verify) ok = verify_file(options.output, file_name(i), file_size);
+                remove(options.output.c_str());
+            }
+
+            double gb = bytes / (1024.0 * 1024.0 * 1024.0);
+            all_ok = all_ok && ok;
+
+            std::cout << std::left << std::setw(18) << label << std::right << std::fixed
+                      << std::setw(12) << std::setprecision(1) << (seconds > 0 ? bytes / (1024.0 * 1024.0) / seconds : 0)
+                      << std::setw(12) << std::setprecision(1) << first_byte / config.files * 1000
+                      << std::setw(12) << std::setprecision(3) << (gb > 0 ? cpu / gb : 0)
+                      << std::setw(10) << retries << std::setw(8) << (ok ? "yes" : "NO") << "\n";
+        }
+    }
+
+    rmdir(dir.c_str());
+    kill(server, SIGTERM);
+    waitpid(server, nullptr, 0);
+    return all_ok ? 0 : 1;
+}
@@ -0,0 +1,449 @@
+#include "range_server.h"
+#include "piece_manifest.h"
+#include "sha256.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// --- 1. Synthetic Content ---
+static uint64_t name_hash(const std::string& name) {
+    uint64_t h = 1469598103934665603ULL; // FNV-1a
+    for (unsigned char c : name) {
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static uint64_t mix(uint64_t x) { // splitmix64
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+void RangeServer::fill(const std::string& name, long long offset, char* out, size_t len, int version) {
+    uint64_t base = name_hash(name) + mix((uint64_t)version);
+    while (len > 0) {
+        uint64_t word = mix(base + (uint64_t)(offset >> 3));
+        for (int i = offset & 7; i < 8 && len > 0; i++, offset++, len--) {
+            *out++ = (char)(word >> (8 * i));
+        }
+    }
+}
+
+// --- 2. Setup & Teardown ---
+RangeServer::RangeServer(RangeServerConfig config) : config_(config), rng_(config.seed) {}
+
+RangeServer::~RangeServer() { stop(); }
+
+void RangeServer::add_file(const std::string& name, long long size) {
+    std::lock_guard<std::mutex> lock(files_mutex_);
+    files_[name].size = size;
+}
+
+void RangeServer::add_fault(Fault fault) {
+    std::lock_guard<std::mutex> lock(files_mutex_);
+    faults_.push_back(fault);
+}
+
+int RangeServer::version(const std::string& name) {
+    std::lock_guard<std::mutex> lock(files_mutex_);
+    return files_[name].version;
+}
+
+void RangeServer::change_version(const std::string& name) {
+    std::lock_guard<std::mutex> lock(files_mutex_);
+    files_[name].version++;
+}
+
+std::string RangeServer::url(const std::string& name) const {
+    return "http://127.0.0.1:" + std::to_string(port_) + "/" + name;
+}
+
+std::map<std::string, int> RangeServer::connections_by_address() {
+    std::lock_guard<std::mutex> lock(connections_mutex_);
+    return connections_by_address_;
+}
+
+std::map<std::string, int> RangeServer::requests_by_address() {
+    std::lock_guard<std::mutex> lock(connections_mutex_);
+    return requests_by_address_;
+}
+
+std::map<std::string, int> RangeServer::requests_by_client() {
+    std::lock_guard<std::mutex> lock(connections_mutex_);
+    return requests_by_client_;
+}
+
+int RangeServer::start(int port) {
+    listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd_ < 0) return -1;
+
+    int yes = 1;
+    setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    if (inet_pton(AF_INET, config_.bind_address.c_str(), &addr.sin_addr) != 1) {
+        close(listen_fd_);
+        listen_fd_ = -1;
+        return -1;
+    }
+    addr.sin_port = htons(port);
+    if (bind(listen_fd_, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd_, 128) < 0) {
+        close(listen_fd_);
+        listen_fd_ = -1;
+        return -1;
+    }
+
+    socklen_t addr_len = sizeof(addr);
+    getsockname(listen_fd_, (sockaddr*)&addr, &addr_len);
+    port_ = ntohs(addr.sin_port);
+
+    running_ = true;
+    accept_thread_ = std::thread(&RangeServer::accept_loop, this);
+    return port_;
+}
+
+void RangeServer::stop() {
+    if (!running_.exchange(false)) return;
+
+    // shutdown() wakes up the blocking accept() and recv() calls
+    shutdown(listen_fd_, SHUT_RDWR);
+    accept_thread_.join();
+    close(listen_fd_);
+    listen_fd_ = -1;
+
+    std::vector<std::thread> threads;
+    {
+        std::lock_guard<std::mutex> lock(connections_mutex_);
+        for (int fd : open_fds_) shutdown(fd, SHUT_RDWR);
+        threads.swap(connection_threads_);
+    }
+    for (auto& t : threads) t.join();
+}
+
+void RangeServer::accept_loop() {
+    while (running_) {
+        int fd = accept(listen_fd_, nullptr, nullptr);
+        if (fd < 0) {
+            if (!running_) return;
+            continue;
+        }
+
+        int yes = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        connections_++;
+
+        Connection connection = {fd, "", ""};
+        sockaddr_in local = {}, client = {};
+        socklen_t local_len = sizeof(local), client_len = sizeof(client);
+        char address[INET_ADDRSTRLEN];
+        if (getsockname(fd, (sockaddr*)&local, &local_len) == 0 &&
+            inet_ntop(AF_INET, &local.sin_addr, address, sizeof(address))) {
+            connection.local_address = address;
+        }
+        if (getpeername(fd, (sockaddr*)&client, &client_len) == 0 &&
+            inet_ntop(AF_INET, &client.sin_addr, address, sizeof(address))) {
+            connection.client_address = address;
+        }
+
+        std::lock_guard<std::mutex> lock(connections_mutex_);
+        connections_by_address_[connection.local_address]++;
+        open_fds_.insert(fd);
+        connection_threads_.push_back(std::thread(&RangeServer::serve_connection, this, connection));
+    }
+}
+
+// --- 3. HTTP Handling ---
+static std::string lower(std::string s) {
+    std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c){ return std::tolower(c); });
+    return s;
+}
+
+static std::string trim(const std::string& s) {
+    size_t begin = s.find_first_not_of(" \t");
+    if (begin == std::string::npos) return "";
+    size_t end = s.find_last_not_of(" \t\r");
+    return s.substr(begin, end - begin + 1);
+}
+
+void RangeServer::serve_connection(Connection connection) {
+    int fd = connection.fd;
+    std::string pending;
+    char buffer[8192];
+
+    while (running_) {
+        // Read until we have a whole header block
+        size_t header_end;
+        while ((header_end = pending.find("\r\n\r\n")) == std::string::npos) {
+            ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+            if (n <= 0 || pending.size() > 64 * 1024) {
+                header_end = std::string::npos;
+                break;
+            }
+            pending.append(buffer, n);
+        }
+        if (header_end == std::string::npos) break;
+
+        Request request;
+        std::string head = pending.substr(0, header_end + 2);
+        pending.erase(0, header_end + 4);
+
+        size_t line_end = head.find("\r\n");
+        std::string request_line = head.substr(0, line_end);
+        size_t sp1 = request_line.find(' ');
+        size_t sp2 = request_line.find(' ', sp1 + 1);
+        if (sp1 == std::string::npos || sp2 == std::string::npos) break;
+        request.method = request_line.substr(0, sp1);
+        request.path = request_line.substr(sp1 + 1, sp2 - sp1 - 1);
+
+        size_t pos = line_end + 2;
+        while (pos < head.size()) {
+            size_t next = head.find("\r\n", pos);
+            std::string line = head.substr(pos, next - pos);
+            size_t colon = line.find(':');
+            if (colon != std::string::npos) {
+                request.headers[lower(line.substr(0, colon))] = trim(line.substr(colon + 1));
+            }
+            pos = next + 2;
+        }
+
+        requests_++;
+        {
+            std::lock_guard<std::mutex> lock(connections_mutex_);
+            requests_by_address_[connection.local_address]++;
+            requests_by_client_[connection.client_address]++;
+        }
+        busy_++;
+        bool keep_going = handle_request(connection, request);
+        busy_--;
+        if (!keep_going) break;
+        if (lower(request.headers["connection"]) == "close") break;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(connections_mutex_);
+        open_fds_.erase(fd);
+    }
+    close(fd);
+}
+
+// Parses "bytes=a-b", "bytes=a-" and "bytes=-n". False if the range can't be served.
+static bool parse_range(const std::string& value, long long size, long long& first, long long& last) {
+    if (value.compare(0, 6, "bytes=") != 0) return false;
+    std::string spec = value.substr(6);
+    size_t dash = spec.find('-');
+    if (dash == std::string::npos || spec.find(',') != std::string::npos) return false;
+
+    std::string a = spec.substr(0, dash), b = spec.substr(dash + 1);
+    try {
+        if (a.empty()) {
+            if (b.empty()) return false;
+            long long suffix = std::stoll(b);
+            first = std::max(0LL, size - suffix);
+            last = size - 1;
+        } else {
+            first = std::stoll(a);
+            last = b.empty() ? size - 1 : std::min(std::stoll(b), size - 1);
+        }
+    } catch (const std::exception&) {
+        return false;
+    }
+    return first <= last && first < size;
+}
+
+bool RangeServer::handle_request(const Connection& connection, const Request& request) {
+    int fd = connection.fd;
+    int delay = random_delay_ms();
+    if (delay > 0) std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+
+    std::string name = request.path.substr(0, request.path.find('?'));
+    if (!name.empty() && name[0] == '/') name.erase(0, 1);
+    const std::string manifest_suffix = ".pieces";
+    if (config_.piece_size > 0 && name.size() > manifest_suffix.size() &&
+        name.compare(name.size() - manifest_suffix.size(), manifest_suffix.size(), manifest_suffix) == 0) {
+        return send_manifest(fd, request, name.substr(0, name.size() - manifest_suffix.size()));
+    }
+
+    // Look the file up and work out which faults this request runs into
+    bool found = false;
+    File file;
+    std::vector<Fault> faults;
+    {
+        std::lock_guard<std::mutex> lock(files_mutex_);
+        auto it = files_.find(name);
+        if (it != files_.end() && request.method == "GET") {
+            gets_++;
+            for (const Fault& fault : faults_) {
+                if (fault.request != 0 && fault.request != gets_) continue;
+                if (fault.kind == FaultKind::ChangeVersion) it->second.version++;
+                else faults.push_back(fault);
+            }
+        }
+        if (it != files_.end()) {
+            found = true;
+            file = it->second;
+        }
+    }
+
+    if (!found || (request.method != "GET" && request.method != "HEAD")) {
+        std::string response = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+        return send_all(fd, response.data(), response.size());
+    }
+
+    bool ignore_range = false;
+    long long short_body = -1, cut_at = -1, bandwidth = config_.bandwidth;
+    auto edge = config_.bandwidth_by_address.find(connection.local_address);
+    if (edge != config_.bandwidth_by_address.end()) bandwidth = edge->second;
+    auto uplink = config_.bandwidth_by_client.find(connection.client_address);
+    if (uplink != config_.bandwidth_by_client.end()) bandwidth = uplink->second;
+    for (const Fault& fault : faults) {
+        switch (fault.kind) {
+            case FaultKind::DropAfter: cut_at = fault.bytes; break;
+            case FaultKind::ShortBody: short_body = fault.bytes; break;
+            case FaultKind::IgnoreRange: ignore_range = true; break;
+            case FaultKind::Throttle: bandwidth = fault.bytes; break;
+            case FaultKind::ChangeVersion: break;
+        }
+    }
+
+    long long size = file.size;
+    std::string etag = "\"" + name + "-" + std::to_string(size) + "-v" + std::to_string(file.version) + "\"";
+    long long first = 0, last = size - 1;
+    std::string status = "200 OK";
+    std::string extra;
+
+    // If-None-Match: the client's copy is still current
+    auto if_none_match = request.headers.find("if-none-match");
+    if (if_none_match != request.headers.end() && if_none_match->second == etag) {
+        std::string response = "HTTP/1.1 304 Not Modified\r\nETag: " + etag + "\r\n\r\n";
+        return send_all(fd, response.data(), response.size());
+    }
+
+    // If-Range: only honour the Range when the client still has the current version
+    auto if_range = request.headers.find("if-range");
+    if (if_range != request.headers.end() && if_range->second != etag) ignore_range = true;
+
+    auto range = request.headers.find("range");
+    if (range != request.headers.end() && !ignore_range) {
+        if (!parse_range(range->second, size, first, last)) {
+            std::string response = "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */" +
+                                   std::to_string(size) + "\r\nContent-Length: 0\r\n\r\n";
+            return send_all(fd, response.data(), response.size());
+        }
+        if (short_body >= 0) last = std::min(last, first + std::max(short_body, 1LL) - 1);
+        status = "206 Partial Content";
+        extra = "Content-Range: bytes " + std::to_string(first) + "-" + std::to_string(last) + "/" +
+                std::to_string(size) + "\r\n";
+    }
+
+    long long length = last - first + 1;
+    std::string response = "HTTP/1.1 " + status + "\r\n"
+                           "Content-Type: application/octet-stream\r\n"
+                           "Accept-Ranges: bytes\r\n"
+                           "ETag: " + etag + "\r\n"
+                           "Content-Length: " + std::to_string(length) + "\r\n" + extra + "\r\n";
+    if (!send_all(fd, response.data(), response.size())) return false;
+    if (request.method == "HEAD") return true;
+
+    if (cut_at < 0 && should_drop()) {
+        std::lock_guard<std::mutex> lock(rng_mutex_);
+        cut_at = std::uniform_int_distribution<long long>(0, length - 1)(rng_);
+    }
+    return send_body(fd, name, file.version, first, length, cut_at, bandwidth);
+}
+
+// Hashed afresh every time, so it always describes the version being served
+bool RangeServer::send_manifest(int fd, const Request& request, const std::string& name) {
+    File file;
+    bool found = false;
+    {
+        std::lock_guard<std::mutex> lock(files_mutex_);
+        auto it = files_.find(name);
+        if (it != files_.end()) {
+            found = true;
+            file = it->second;
+        }
+    }
+    if (!found || request.method != "GET") {
+        std::string response = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+        return send_all(fd, response.data(), response.size());
+    }
+
+    PieceManifest manifest;
+    manifest.piece_size = config_.piece_size;
+    manifest.size = file.size;
+    std::vector<char> piece;
+    for (long long offset = 0; offset < file.size; offset += config_.piece_size) {
+        piece.resize(std::min(config_.piece_size, file.size - offset));
+        fill(name, offset, piece.data(), piece.size(), file.version);
+        Sha256 hash;
+        hash.update(piece.data(), piece.size());
+        manifest.hashes.push_back(hash.hex());
+    }
+    std::string body = render_piece_manifest(manifest);
+    std::string response = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: " +
+                           std::to_string(body.size()) + "\r\n\r\n" + body;
+    return send_all(fd, response.data(), response.size());
+}
+
+bool RangeServer::send_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Streams the body in small pieces, sleeping between them to hold the
+// configured bandwidth. cut_at >= 0 drops the connection after that many bytes.
+bool RangeServer::send_body(int fd, const std::string& name, int version, long long offset, long long len,
+                            long long cut_at, long long bandwidth) {
+    const size_t piece_size = bandwidth > 0
+        ? (size_t)std::clamp(bandwidth / 50, 1024LL, 64 * 1024LL)
+        : 64 * 1024;
+    std::vector<char> piece(piece_size);
+
+    auto started = std::chrono::steady_clock::now();
+    long long sent = 0;
+    while (sent < len) {
+        size_t n = (size_t)std::min<long long>(piece_size, len - sent);
+        if (cut_at >= 0 && sent + (long long)n > cut_at) n = (size_t)(cut_at - sent);
+
+        fill(name, offset + sent, piece.data(), n, version);
+        if (!send_all(fd, piece.data(), n)) return false;
+        sent += n;
+        bytes_sent_ += n;
+
+        if (cut_at >= 0 && sent >= cut_at && sent < len) return false; // hang up mid-body
+
+        if (bandwidth > 0) {
+            auto due = started + std::chrono::microseconds(sent * 1000000 / bandwidth);
+            std::this_thread::sleep_until(due);
+        }
+    }
+    return running_;
+}
+
+int RangeServer::random_delay_ms() {
+    if (config_.jitter_ms <= 0) return config_.latency_ms;
+    std::lock_guard<std::mutex> lock(rng_mutex_);
+    return config_.latency_ms + std::uniform_int_distribution<int>(0, config_.jitter_ms)(rng_);
+}
+
+bool RangeServer::should_drop() {
+    if (config_.drop_rate <= 0) return false;
+    std::lock_guard<std::mutex> lock(rng_mutex_);
+    return std::uniform_real_distribution<double>(0, 1)(rng_) < config_.drop_rate;
+}
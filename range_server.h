@@ -0,0 +1,145 @@
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+// --- Local Range Server ---
+// A small HTTP/1.1 file server for benchmarks and tests, so nothing depends on
+// speedtest.tele2.net being up. Files are synthetic: every byte comes from a
+// hash of (name, offset), so a multi-GB file costs no memory and any range can
+// be checked without keeping a copy around.
+//
+// Crow is not used here on purpose. It builds the whole response body before
+// sending it, so it can neither pace a transfer nor cut one off halfway.
+
+struct RangeServerConfig {
+    long long bandwidth = 0; // bytes per second per connection, 0 = as fast as possible
+    int latency_ms = 0;      // delay before every response
+    int jitter_ms = 0;       // extra random delay, up to this much
+    double drop_rate = 0.0;  // chance that a response is cut off in the middle of the body
+    unsigned seed = 1;       // for the random delays and drops
+    // Where to listen. "0.0.0.0" also answers on 127.0.0.2 and friends, for
+    // tests that need a host with several addresses.
+    std::string bind_address = "127.0.0.1";
+    // Per-connection bandwidth for clients that connected to a particular local
+    // address, overriding `bandwidth`. Makes one "edge" slower than the others.
+    std::map<std::string, long long> bandwidth_by_address;
+    // The same by the client's address, to play a slow uplink on our side
+    std::map<std::string, long long> bandwidth_by_client;
+    // Also serve <file>.pieces, the piece manifest of the file's current
+    // version (piece_manifest.h), with pieces this big. 0 = no manifests.
+    long long piece_size = 0;
+};
+
+// Faults for the test harness. Each one hits the Nth GET the server answers
+// (counting from 1), or every GET when `request` is 0.
+enum class FaultKind {
+    DropAfter,     // hang up after `bytes` bytes of the body
+    ShortBody,     // answer with only the first `bytes` bytes of the range (a valid but short 206)
+    IgnoreRange,   // answer 200 with the whole file, as if Range wasn't supported
+    ChangeVersion, // the file changes (new content, new ETag) right before this request
+    Throttle,      // send this one response at `bytes` bytes per second
+};
+
+struct Fault {
+    FaultKind kind;
+    int request = 0;
+    long long bytes = 0;
+};
+
+class RangeServer {
+public:
+    explicit RangeServer(RangeServerConfig config = RangeServerConfig());
+    ~RangeServer();
+    RangeServer(const RangeServer&) = delete;
+    RangeServer& operator=(const RangeServer&) = delete;
+
+    void add_file(const std::string& name, long long size);
+    void add_fault(Fault fault);
+
+    // Binds the config's bind_address (127.0.0.1 unless set) and starts
+    // serving. Port 0 picks a free one. url() says 127.0.0.1 either way.
+    // Returns the port, or -1 if we could not listen.
+    int start(int port = 0);
+    void stop();
+
+    int port() const { return port_; }
+    std::string url(const std::string& name) const;
+
+    long long requests() const { return requests_.load(); }
+    long long connections() const { return connections_.load(); }
+    // Connections accepted and requests answered, by the local address the client connected to
+    std::map<std::string, int> connections_by_address();
+    std::map<std::string, int> requests_by_address();
+    std::map<std::string, int> requests_by_client(); // by the address the client connected from
+    // Connections in the middle of sending a response. A client that hangs up
+    // mid-body drops out of this on the server's next write.
+    int busy_connections() const { return busy_.load(); }
+    long long bytes_sent() const { return bytes_sent_.load(); }
+    int version(const std::string& name);
+    // The file changes (new content, new ETag), like a ChangeVersion fault but right now
+    void change_version(const std::string& name);
+
+    // The content of a synthetic file, for checking downloads.
+    // Every ChangeVersion fault moves the file on to the next version.
+    static void fill(const std::string& name, long long offset, char* out, size_t len, int version = 1);
+
+private:
+    struct Request {
+        std::string method;
+        std::string path;
+        std::map<std::string, std::string> headers; // keys are lower case
+    };
+
+    void accept_loop();
+    struct Connection {
+        int fd;
+        std::string local_address;
+        std::string client_address;
+    };
+
+    void serve_connection(Connection connection);
+    bool handle_request(const Connection& connection, const Request& request);
+    bool send_manifest(int fd, const Request& request, const std::string& name);
+    bool send_all(int fd, const char* data, size_t len);
+    bool send_body(int fd, const std::string& name, int version, long long offset, long long len,
+                   long long cut_at, long long bandwidth);
+    int random_delay_ms();
+    bool should_drop();
+
+    struct File {
+        long long size = 0;
+        int version = 1;
+    };
+
+    RangeServerConfig config_;
+    std::mutex files_mutex_;
+    std::map<std::string, File> files_;
+    std::vector<Fault> faults_;
+    int gets_ = 0; // guarded by files_mutex_
+    int listen_fd_ = -1;
+    int port_ = -1;
+    std::atomic<bool> running_{false};
+    std::thread accept_thread_;
+
+    std::mutex connections_mutex_;
+    std::vector<std::thread> connection_threads_;
+    std::set<int> open_fds_;
+    std::map<std::string, int> connections_by_address_;
+    std::map<std::string, int> requests_by_address_;
+    std::map<std::string, int> requests_by_client_;
+
+    std::mutex rng_mutex_;
+    std::mt19937 rng_;
+
+    std::atomic<long long> requests_{0};
+    std::atomic<long long> connections_{0};
+    std::atomic<long long> bytes_sent_{0};
+    std::atomic<int> busy_{0};
+};
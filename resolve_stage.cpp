@@ -0,0 +1,119 @@
+#include "resolve_stage.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+ResolveStage::ResolveStage(std::shared_ptr<LinkResolver> resolver, int workers, size_t lookahead,
+                           long long small_file_limit,
+                           std::function<bool(const std::string&, const std::string&)> probe_link)
+    : resolver_(std::move(resolver)), lookahead_(std::max<size_t>(lookahead, 1)),
+      small_file_limit_(small_file_limit), probe_link_(std::move(probe_link)) {
+    for (int i = 0; i < std::max(workers, 1); i++) workers_.emplace_back(&ResolveStage::work, this);
+}
+
+ResolveStage::~ResolveStage() {
+    stop();
+    for (std::thread& worker : workers_) worker.join();
+}
+
+size_t ResolveStage::push(const std::vector<QueuedJob>& jobs) {
+    size_t depth;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queued_.insert(queued_.end(), jobs.begin(), jobs.end());
+        depth = queued_.size() + resolving_ + ready_.size();
+    }
+    work_cv_.notify_all();
+    return depth;
+}
+
+bool ResolveStage::pop(ResolvedJob& job) {
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ready_cv_.wait(lock, [&]{ return !ready_.empty() || stopping_; });
+        if (ready_.empty()) return false;
+        job = std::move(ready_.front());
+        ready_.pop_front();
+    }
+    work_cv_.notify_one(); // there's room for one more ahead
+    return true;
+}
+
+void ResolveStage::requeue(ResolvedJob job) {
+    job.probes.clear(); // the download probes for itself
+    if (!job.links.empty() && links_expired(job.links)) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            queued_.push_front({job.id, job.url});
+        }
+        work_cv_.notify_all();
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ready_.push_front(std::move(job));
+    }
+    ready_cv_.notify_one();
+}
+
+size_t ResolveStage::waiting() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return queued_.size() + resolving_ + ready_.size();
+}
+
+void ResolveStage::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    work_cv_.notify_all();
+    ready_cv_.notify_all();
+}
+
+void ResolveStage::work() {
+    while (true) {
+        QueuedJob queued;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            work_cv_.wait(lock, [&]{
+                return stopping_ || (!queued_.empty() && resolving_ + ready_.size() < lookahead_);
+            });
+            if (stopping_) return;
+            queued = std::move(queued_.front());
+            queued_.pop_front();
+            resolving_++;
+        }
+
+        ResolvedJob job = resolve(queued);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            resolving_--;
+            ready_.push_back(std::move(job));
+        }
+        ready_cv_.notify_one();
+    }
+}
+
+ResolvedJob ResolveStage::resolve(const QueuedJob& queued) {
+    ResolvedJob job;
+    job.id = queued.id;
+    job.url = queued.url;
+    try {
+        job.links = resolver_->resolve(queued.url);
+    } catch (const std::exception& e) {
+        job.error = e.what();
+        return job;
+    }
+
+    for (const std::string& link : job.links) {
+        if (probe_link_ && !probe_link_(queued.url, link)) {
+            job.probes.push_back(nullptr);
+            continue;
+        }
+        auto probe = std::make_shared<ProbeResult>();
+        probe->info = probe_remote(link, small_file_limit_, probe->first_bytes);
+        job.probes.push_back(probe->info.size > 0 ? probe : nullptr);
+    }
+    return job;
+}
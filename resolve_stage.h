@@ -0,0 +1,83 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "downloader.h"
+#include "resolver.h"
+
+// --- Resolve Stage ---
+// Sits between the job queue and the download slots. Its own threads turn
+// queued URLs into direct links and probe them (size, ETag, the first bytes
+// of small files) while the downloads ahead of them are still running, so a
+// free slot gets a job that can start transferring straight away.
+//
+// It only works `lookahead` jobs ahead: links expire and probes go stale,
+// and every probe can hold up to small_file_limit bytes.
+
+struct QueuedJob {
+    uint64_t id = 0; // the caller's, handed back in ResolvedJob
+    std::string url;
+};
+
+struct ResolvedJob {
+    uint64_t id = 0;
+    std::string url;                // as queued
+    std::vector<std::string> links; // direct links, one per stream; empty if resolving failed
+    // One per link, for DownloadOptions::probed. Null where the probe failed;
+    // the download then probes (and reports the failure) itself.
+    std::vector<std::shared_ptr<const ProbeResult>> probes;
+    std::string error;              // why there are no links
+};
+
+class ResolveStage {
+public:
+    // `probe_link` picks the links worth probing ahead (given the queued URL
+    // too), null for all of them: a link whose download will ask the server
+    // conditionally (DownloadOptions::previous) is better left to that probe.
+    ResolveStage(std::shared_ptr<LinkResolver> resolver, int workers, size_t lookahead,
+                 long long small_file_limit = 1 << 20,
+                 std::function<bool(const std::string& url, const std::string& link)> probe_link = nullptr);
+    ~ResolveStage();
+
+    // Queues the jobs and returns how many are now waiting for a slot
+    size_t push(const std::vector<QueuedJob>& jobs);
+
+    // The next job that is ready, in the order they became ready. A slow
+    // link doesn't hold up the ones behind it. Blocks; false once stopped.
+    bool pop(ResolvedJob& job);
+
+    // Puts a job that was already popped back at the front of the line (a
+    // resumed download). Its probes are stale by now and go; its links are
+    // kept unless they have expired, in which case it is resolved again.
+    void requeue(ResolvedJob job);
+
+    // Queued, resolving or ready
+    size_t waiting() const;
+
+    void stop();
+
+private:
+    void work();
+    ResolvedJob resolve(const QueuedJob& queued);
+
+    std::shared_ptr<LinkResolver> resolver_;
+    size_t lookahead_;
+    long long small_file_limit_;
+    std::function<bool(const std::string&, const std::string&)> probe_link_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable work_cv_;  // resolvers: work to do and room ahead
+    std::condition_variable ready_cv_; // download slots: a job is ready
+    std::deque<QueuedJob> queued_;
+    std::deque<ResolvedJob> ready_;
+    size_t resolving_ = 0;
+    bool stopping_ = false;
+    std::vector<std::thread> workers_;
+};
@@ -0,0 +1,357 @@
+#include "resolver.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdlib>
+#include <ctime>
+#include <fcntl.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <spawn.h>
+#include <stdexcept>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+
+extern char** environ;
+
+constexpr int RESOLVER_PROCESSES = 2;          // yt-dlp is slow but light; more would mostly sit idle
+constexpr int RESOLVER_STARTUP_MS = 30000;     // python3 + import yt_dlp
+constexpr int RESOLVE_TIMEOUT_MS = 60000;      // one extraction
+constexpr int LINK_EXPIRY_MARGIN = 600;        // seconds; a link has to last for the whole download
+constexpr int LINK_DEFAULT_TTL = 3600;         // seconds, for links without an expire= parameter
+constexpr size_t LINK_CACHE_MAX = 10000;
+
+// --- 1. The Resolver Process ---
+// Reads "<tag>\t<format>\t<url>" lines, answers each with "<tag> OK <link>
+// <link>..." or "<tag> ERR <message>". The tag is the request's own, so an
+// answer to anything else gives a process that lost track away. Says READY
+// once yt_dlp is imported.
+static const char* RESOLVER_SCRIPT = R"(
+import sys
+try:
+    import yt_dlp
+except Exception as e:
+    print("ERR cannot import yt_dlp: %s" % e, flush=True)
+    sys.exit(1)
+print("READY", flush=True)
+for line in sys.stdin:
+    tag, _, rest = line.rstrip("\n").partition("\t")
+    fmt, _, url = rest.partition("\t")
+    try:
+        options = {"format": fmt, "quiet": True, "no_warnings": True, "noplaylist": True}
+        with yt_dlp.YoutubeDL(options) as ydl:
+            info = ydl.extract_info(url, download=False)
+        streams = info.get("requested_formats") or [info]
+        links = [s.get("url") for s in streams if s.get("url")]
+        print(tag + (" OK " + " ".join(links) if links else " ERR no direct link for this format"), flush=True)
+    except Exception as e:
+        message = (str(e).strip().splitlines() or [type(e).__name__])[-1]
+        print(tag + " ERR " + message, flush=True)
+)";
+
+struct ResolverProcess {
+    pid_t pid = -1;
+    int to_child = -1;   // its stdin
+    int from_child = -1; // its stdout (and stderr, for the yt-dlp CLI)
+    std::string pending; // read, but not a whole line yet
+
+    ~ResolverProcess() {
+        if (to_child >= 0) close(to_child);
+        if (from_child >= 0) close(from_child);
+        if (pid > 0) {
+            kill(pid, SIGKILL);
+            waitpid(pid, nullptr, 0);
+        }
+    }
+};
+
+// posix_spawn rather than popen: no shell, so a URL can't smuggle in commands
+static std::unique_ptr<ResolverProcess> spawn(const std::vector<std::string>& args, bool merge_stderr) {
+    int in[2], out[2];
+    if (pipe2(in, O_CLOEXEC) < 0) return nullptr;
+    if (pipe2(out, O_CLOEXEC) < 0) {
+        close(in[0]);
+        close(in[1]);
+        return nullptr;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+    if (merge_stderr) posix_spawn_file_actions_adddup2(&actions, out[1], STDERR_FILENO);
+    else posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+    std::vector<char*> argv;
+    for (const std::string& arg : args) argv.push_back((char*)arg.c_str());
+    argv.push_back(nullptr);
+
+    auto process = std::make_unique<ResolverProcess>();
+    int failed = posix_spawnp(&process->pid, argv[0], &actions, nullptr, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(in[0]);
+    close(out[1]);
+    process->to_child = in[1];
+    process->from_child = out[0];
+    if (failed) {
+        process->pid = -1;
+        return nullptr;
+    }
+    return process;
+}
+
+static bool read_line(ResolverProcess& process, int timeout_ms, std::string& line) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    while (true) {
+        size_t newline = process.pending.find('\n');
+        if (newline != std::string::npos) {
+            line = process.pending.substr(0, newline);
+            process.pending.erase(0, newline + 1);
+            return true;
+        }
+
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        if (left.count() <= 0) return false;
+        pollfd fd = {process.from_child, POLLIN, 0};
+        if (poll(&fd, 1, (int)left.count()) <= 0) return false;
+
+        char buffer[4096];
+        ssize_t n = read(process.from_child, buffer, sizeof(buffer));
+        if (n <= 0) return false;
+        process.pending.append(buffer, n);
+    }
+}
+
+static bool write_all(int fd, const std::string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = write(fd, data.data() + sent, data.size() - sent);
+        if (n <= 0) return false;
+        sent += n;
+    }
+    return true;
+}
+
+// --- 2. The Process Pool ---
+struct ResolverPool {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<std::unique_ptr<ResolverProcess>> idle;
+    int running = 0;          // idle or busy
+    bool unavailable = false; // python3 or yt_dlp is missing, use the CLI instead
+};
+
+static ResolverPool& pool() {
+    static ResolverPool* instance = new ResolverPool;
+    return *instance;
+}
+
+static std::unique_ptr<ResolverProcess> start_resolver() {
+    // A resolver that dies would otherwise take us down with SIGPIPE on the next write
+    static std::once_flag once;
+    std::call_once(once, []{ signal(SIGPIPE, SIG_IGN); });
+
+    std::unique_ptr<ResolverProcess> process = spawn({"python3", "-u", "-c", RESOLVER_SCRIPT}, false);
+    std::string line;
+    if (!process || !read_line(*process, RESOLVER_STARTUP_MS, line) || line != "READY") return nullptr;
+    return process;
+}
+
+// A warm resolver, or nullptr when the pool can't have any
+static std::unique_ptr<ResolverProcess> acquire() {
+    ResolverPool& p = pool();
+    {
+        std::unique_lock<std::mutex> lock(p.mutex);
+        p.cv.wait(lock, [&]{ return p.unavailable || !p.idle.empty() || p.running < RESOLVER_PROCESSES; });
+        if (p.unavailable) return nullptr;
+        if (!p.idle.empty()) {
+            std::unique_ptr<ResolverProcess> process = std::move(p.idle.back());
+            p.idle.pop_back();
+            return process;
+        }
+        p.running++;
+    }
+
+    std::unique_ptr<ResolverProcess> process = start_resolver();
+    if (!process) {
+        std::lock_guard<std::mutex> lock(p.mutex);
+        p.running--;
+        p.unavailable = true;
+        p.cv.notify_all();
+    }
+    return process;
+}
+
+// A process that misbehaved is not put back; the next acquire() starts a new one
+static void release(std::unique_ptr<ResolverProcess> process, bool healthy) {
+    ResolverPool& p = pool();
+    std::lock_guard<std::mutex> lock(p.mutex);
+    if (healthy) {
+        p.idle.push_back(std::move(process));
+    } else {
+        p.running--;
+        process.reset();
+    }
+    p.cv.notify_one();
+}
+
+void resolver_prewarm(int processes) {
+    std::vector<std::unique_ptr<ResolverProcess>> started;
+    for (int i = 0; i < std::min(processes, RESOLVER_PROCESSES); i++) {
+        std::unique_ptr<ResolverProcess> process = acquire();
+        if (!process) break;
+        started.push_back(std::move(process));
+    }
+    for (auto& process : started) release(std::move(process), true);
+}
+
+// --- 3. Resolving ---
+static std::vector<std::string> split_links(const std::string& text) {
+    std::vector<std::string> links;
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t end = text.find_first_of(" \n", pos);
+        if (end == std::string::npos) end = text.size();
+        if (end > pos) links.push_back(text.substr(pos, end - pos));
+        pos = end + 1;
+    }
+    return links;
+}
+
+// Tabs and line breaks would split one request into several
+static bool fits_one_line(const std::string& text) {
+    return std::none_of(text.begin(), text.end(), [](unsigned char c) { return c < 0x20 || c == 0x7f; });
+}
+
+// False if the pool is out of action (or can't take this request) and the caller should use the CLI
+static bool resolve_with_pool(const std::string& url, const std::string& format, std::vector<std::string>& links,
+                              std::string& error) {
+    if (!fits_one_line(url) || !fits_one_line(format)) return false;
+    static std::atomic<unsigned long long> next_tag{1};
+    std::string tag = std::to_string(next_tag++);
+
+    std::string line;
+    bool answered = false;
+    // An idle resolver may have died since its last job; that costs a retry, not the job
+    for (int attempt = 0; attempt < 2 && !answered; attempt++) {
+        std::unique_ptr<ResolverProcess> process = acquire();
+        if (!process) return false;
+
+        bool sent = write_all(process->to_child, tag + "\t" + format + "\t" + url + "\n");
+        answered = sent && read_line(*process, RESOLVE_TIMEOUT_MS, line);
+        // Someone else's answer: the process is out of step, and goes
+        bool ours = answered && line.compare(0, tag.size() + 1, tag + " ") == 0;
+        release(std::move(process), ours);
+        if (answered && !ours) return false;
+        if (sent && !answered) break; // it hung on this URL, a retry would too
+    }
+    if (answered) line = line.substr(tag.size() + 1);
+
+    if (!answered) error = "yt-dlp did not answer in time";
+    else if (line.compare(0, 3, "OK ") == 0) links = split_links(line.substr(3));
+    else error = line.compare(0, 4, "ERR ") == 0 ? line.substr(4) : line;
+    return true;
+}
+
+// The old way: one `yt-dlp -g` per link. Its error is the last line it printed.
+static void resolve_with_cli(const std::string& url, const std::string& format, std::vector<std::string>& links,
+                             std::string& error) {
+    std::unique_ptr<ResolverProcess> process = spawn({"yt-dlp", "-f", format, "-g", "--", url}, true);
+    if (!process) {
+        error = "yt-dlp is not installed";
+        return;
+    }
+    close(process->to_child);
+    process->to_child = -1;
+
+    std::string line, last;
+    while (read_line(*process, RESOLVE_TIMEOUT_MS, line)) {
+        if (line.compare(0, 4, "http") == 0) links.push_back(line);
+        else if (!line.empty()) last = line;
+    }
+
+    int status = 0;
+    waitpid(process->pid, &status, 0);
+    process->pid = -1;
+    if (!links.empty()) return;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 127) error = "yt-dlp is not installed";
+    else error = last.empty() ? "yt-dlp found no link" : last;
+}
+
+// --- 4. The Link Cache ---
+struct CachedLinks {
+    std::vector<std::string> links;
+    std::chrono::system_clock::time_point expires;
+};
+
+static std::mutex cache_mutex;
+static std::map<std::string, CachedLinks> link_cache; // "format\turl"
+
+// CDN links carry their own deadline as a unix time: ...&expire=1700000000&...
+static std::chrono::system_clock::time_point link_expiry(const std::vector<std::string>& links) {
+    auto now = std::chrono::system_clock::now();
+    auto expires = now + std::chrono::seconds(LINK_DEFAULT_TTL);
+    for (const std::string& link : links) {
+        // A parameter of its own, not the tail of one like "max_expire="
+        size_t pos = link.find("?expire=");
+        if (pos == std::string::npos) pos = link.find("&expire=");
+        if (pos == std::string::npos) continue;
+        time_t when = strtoll(link.c_str() + pos + 8, nullptr, 10);
+        if (when > 0) expires = std::min(expires, std::chrono::system_clock::from_time_t(when));
+    }
+    return expires - std::chrono::seconds(LINK_EXPIRY_MARGIN);
+}
+
+bool links_expired(const std::vector<std::string>& links) {
+    return link_expiry(links) <= std::chrono::system_clock::now();
+}
+
+std::vector<std::string> get_direct_links(const std::string& url, const std::string& format) {
+    std::string key = format + "\t" + url;
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        auto it = link_cache.find(key);
+        if (it != link_cache.end() && it->second.expires > std::chrono::system_clock::now()) return it->second.links;
+    }
+
+    std::vector<std::string> links;
+    std::string error;
+    if (!resolve_with_pool(url, format, links, error)) resolve_with_cli(url, format, links, error);
+    if (links.empty()) throw std::runtime_error("Could not extract a link: " + error);
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    if (link_cache.size() >= LINK_CACHE_MAX) {
+        auto now = std::chrono::system_clock::now();
+        for (auto it = link_cache.begin(); it != link_cache.end();) {
+            if (it->second.expires <= now) it = link_cache.erase(it);
+            else ++it;
+        }
+        if (link_cache.size() >= LINK_CACHE_MAX) link_cache.erase(link_cache.begin());
+    }
+    link_cache[key] = {links, link_expiry(links)};
+    return links;
+}
+
+std::string get_direct_link(const std::string& url, const std::string& format) {
+    return get_direct_links(url, format).front();
+}
+
+// --- 5. Pluggable Resolvers ---
+std::vector<std::string> StubResolver::resolve(const std::string& url) {
+    if (delay_ms_ > 0) std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms_));
+    auto it = links_.find(url);
+    if (it == links_.end() || it->second.empty()) throw std::runtime_error("Could not extract a link: no stub for " + url);
+    return it->second;
+}
+
+std::unique_ptr<LinkResolver> make_resolver(const std::string& name) {
+    if (name == "yt-dlp") return std::make_unique<YtDlpResolver>();
+    if (name == "direct") return std::make_unique<DirectResolver>();
+    return nullptr;
+}
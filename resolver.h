@@ -0,0 +1,86 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+// --- Link Resolver ---
+// Turns a page URL (YouTube and friends) into direct media links with
+// yt-dlp. Two things make that cheap after the first time:
+//
+//  * A cache keyed by page URL + format. Links are kept until shortly before
+//    the `expire=` time the CDN signed into them.
+//  * A pool of pre-warmed resolver processes: python3 with yt_dlp already
+//    imported, answering one request per line. That skips the seconds of
+//    interpreter startup a fresh `yt-dlp -g` pays on every call. Where the
+//    yt_dlp module can't be imported we fall back to running `yt-dlp -g`.
+
+constexpr const char* DEFAULT_FORMAT = "18"; // 360p mp4 with audio, one file
+// The best video and the best audio as two links (see media.h), or the best
+// single file where a site doesn't split them. Kept to mp4/m4a so the
+// streams can be muxed into an .mp4 without re-encoding.
+constexpr const char* BEST_FORMAT = "bestvideo[ext=mp4]+bestaudio[ext=m4a]/best[ext=mp4]/best";
+
+// The direct link for `url`. Throws std::runtime_error with yt-dlp's own
+// message when the link can't be extracted.
+std::string get_direct_link(const std::string& url, const std::string& format = DEFAULT_FORMAT);
+
+// Every link the format resolves to (one per stream, e.g. video and audio
+// for "bestvideo+bestaudio"). Throws like get_direct_link().
+std::vector<std::string> get_direct_links(const std::string& url, const std::string& format = DEFAULT_FORMAT);
+
+// True once the `expire=` the CDN signed into any of the links is too close
+// for a download to finish in time. Links without one never are.
+bool links_expired(const std::vector<std::string>& links);
+
+// Starts `processes` resolver processes now, so the first job doesn't wait
+// for Python to start. Optional: the pool starts them on demand too.
+void resolver_prewarm(int processes);
+
+// --- Pluggable Resolvers ---
+// What the resolve stage (resolve_stage.h) calls to turn a queued URL into
+// direct links. Implementations must be safe to call from several threads.
+class LinkResolver {
+public:
+    virtual ~LinkResolver() = default;
+    // One link per stream. Throws std::runtime_error when there are none.
+    virtual std::vector<std::string> resolve(const std::string& url) = 0;
+    // Whatever else decides which links a URL gets (yt-dlp's format), for
+    // keys that have to outlive the links themselves
+    virtual std::string format() const { return ""; }
+};
+
+// Page URLs through yt-dlp, with the cache and process pool above
+class YtDlpResolver : public LinkResolver {
+public:
+    explicit YtDlpResolver(std::string format = BEST_FORMAT) : format_(std::move(format)) {}
+    std::vector<std::string> resolve(const std::string& url) override { return get_direct_links(url, format_); }
+    std::string format() const override { return format_; }
+
+private:
+    std::string format_;
+};
+
+// The queued URL already is the file
+class DirectResolver : public LinkResolver {
+public:
+    std::vector<std::string> resolve(const std::string& url) override { return {url}; }
+};
+
+// A fixed table, for tests. `delay_ms` stands in for how long yt-dlp takes.
+// URLs that aren't in the table fail.
+class StubResolver : public LinkResolver {
+public:
+    explicit StubResolver(std::map<std::string, std::vector<std::string>> links, int delay_ms = 0)
+        : links_(std::move(links)), delay_ms_(delay_ms) {}
+    std::vector<std::string> resolve(const std::string& url) override;
+
+private:
+    std::map<std::string, std::vector<std::string>> links_;
+    int delay_ms_;
+};
+
+// "yt-dlp" or "direct" (the stub needs its table, so it has no name).
+// nullptr for anything else.
+std::unique_ptr<LinkResolver> make_resolver(const std::string& name);
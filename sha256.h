@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// --- SHA-256 ---
+// What the download cache names its files by. Small enough to carry here
+// rather than ask for OpenSSL's headers on top of libcurl's.
+
+class Sha256 {
+public:
+    Sha256();
+    void update(const void* data, size_t size);
+    std::string hex(); // 64 lowercase hex digits; call once, at the end
+
+private:
+    void block(const uint8_t* data);
+
+    uint32_t state_[8];
+    uint8_t buffer_[64];
+    size_t buffered_ = 0;
+    uint64_t length_ = 0; // bytes so far
+};
+
+// SHA-256 of the whole file, or "" if it can't be read
+std::string sha256_file(const std::string& path);
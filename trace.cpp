@@ -0,0 +1,160 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// --- 1. Per-Thread Rings ---
+constexpr size_t TRACE_RING_SIZE = 16384; // events per thread
+
+struct TraceEvent {
+    uint32_t job;
+    int track;
+    const char* name;
+    char phase; // 'X' = has a duration, 'i' = a single point in time
+    long long ts;
+    long long duration;
+    long long value;
+};
+
+// The mutex is only ever contended while a dump copies the ring out, so
+// recording stays a handful of stores.
+struct TraceRing {
+    std::mutex mutex;
+    std::vector<TraceEvent> events = std::vector<TraceEvent>(TRACE_RING_SIZE);
+    size_t next = 0;
+    bool wrapped = false;
+
+    void record(const TraceEvent& event) {
+        std::lock_guard<std::mutex> lock(mutex);
+        events[next] = event;
+        if (++next == TRACE_RING_SIZE) {
+            next = 0;
+            wrapped = true;
+        }
+    }
+};
+
+struct TraceRegistry {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<TraceRing>> rings;
+    std::vector<TraceRing*> free_rings;
+    std::atomic<uint32_t> next_job{1};
+    std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+};
+
+static TraceRegistry& registry() {
+    static TraceRegistry* instance = new TraceRegistry; // outlives every thread_local
+    return *instance;
+}
+
+// Segment threads are short-lived, so rings are recycled instead of freed.
+// Whatever a ring holds stays there until it gets overwritten.
+struct RingHandle {
+    TraceRing* ring = nullptr;
+
+    RingHandle() {
+        TraceRegistry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        if (!r.free_rings.empty()) {
+            ring = r.free_rings.back();
+            r.free_rings.pop_back();
+        } else {
+            r.rings.push_back(std::make_unique<TraceRing>());
+            r.free_rings.reserve(r.rings.size());
+            ring = r.rings.back().get();
+        }
+    }
+
+    ~RingHandle() {
+        TraceRegistry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.free_rings.push_back(ring);
+    }
+};
+
+static TraceRing& my_ring() {
+    thread_local RingHandle handle;
+    return *handle.ring;
+}
+
+// --- 2. Recording ---
+uint32_t trace_new_job() { return registry().next_job.fetch_add(1); }
+
+long long trace_now() {
+    auto elapsed = std::chrono::steady_clock::now() - registry().epoch;
+    return std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+}
+
+void trace_complete(uint32_t job, int track, const char* name, long long start_us, long long duration_us,
+                    long long bytes) {
+    if (job == 0) return;
+    my_ring().record({job, track, name, 'X', start_us, std::max(0LL, duration_us), bytes});
+}
+
+void trace_instant(uint32_t job, int track, const char* name, long long value) {
+    if (job == 0) return;
+    my_ring().record({job, track, name, 'i', trace_now(), 0, value});
+}
+
+// --- 3. Chrome Trace Export ---
+static std::string track_name(int track) {
+    if (track == TRACE_TRACK_JOB) return "job";
+    if (track == TRACE_TRACK_WRITER) return "writer";
+    return "segment " + std::to_string(track - TRACE_TRACK_SEGMENT);
+}
+
+bool trace_dump(uint32_t job, const std::string& path) {
+    if (job == 0) return false;
+
+    std::vector<TraceEvent> events;
+    {
+        TraceRegistry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        for (auto& ring : r.rings) {
+            std::lock_guard<std::mutex> ring_lock(ring->mutex);
+            size_t count = ring->wrapped ? TRACE_RING_SIZE : ring->next;
+            for (size_t i = 0; i < count; i++) {
+                if (ring->events[i].job == job) events.push_back(ring->events[i]);
+            }
+        }
+    }
+    std::sort(events.begin(), events.end(), [](const TraceEvent& a, const TraceEvent& b) { return a.ts < b.ts; });
+
+    std::ofstream out(path);
+    if (!out) return false;
+
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    bool first = true;
+    auto separator = [&]() -> std::ostream& {
+        if (!first) out << ",\n";
+        first = false;
+        return out;
+    };
+
+    // Name every row once so the viewer shows "segment 3" instead of a number
+    std::map<int, bool> tracks;
+    for (const TraceEvent& event : events) tracks[event.track] = true;
+    for (const auto& track : tracks) {
+        separator() << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << job << ",\"tid\":" << track.first
+                    << ",\"args\":{\"name\":\"" << track_name(track.first) << "\"}}";
+        separator() << "{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":" << job << ",\"tid\":" << track.first
+                    << ",\"args\":{\"sort_index\":" << track.first << "}}";
+    }
+
+    for (const TraceEvent& event : events) {
+        separator() << "{\"name\":\"" << event.name << "\",\"cat\":\"download\",\"ph\":\"" << event.phase
+                    << "\",\"ts\":" << event.ts << ",\"pid\":" << job << ",\"tid\":" << event.track;
+        if (event.phase == 'X') out << ",\"dur\":" << event.duration;
+        else out << ",\"s\":\"t\"";
+        if (event.value >= 0) out << ",\"args\":{\"value\":" << event.value << "}";
+        out << "}";
+    }
+    out << "\n]}\n";
+    return out.good();
+}
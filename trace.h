@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// --- Tracing ---
+// Optional per-job timelines. Each thread records events into its own ring
+// buffer (the oldest events get overwritten when it wraps), and trace_dump()
+// collects one job's events into a Chrome/Perfetto JSON trace. Open the file
+// in chrome://tracing or ui.perfetto.dev.
+//
+// Jobs that don't ask for a trace have job id 0, and every call below returns
+// right away for those, so tracing costs nothing unless it is switched on.
+
+// Tracks are the rows of the timeline. Segments use TRACE_TRACK_SEGMENT + id.
+constexpr int TRACE_TRACK_JOB = 0;
+constexpr int TRACE_TRACK_WRITER = 1;
+constexpr int TRACE_TRACK_SEGMENT = 2;
+
+uint32_t trace_new_job();  // id for a job that wants a trace
+long long trace_now();     // microseconds on the trace clock
+
+// `name` must be a string literal (we keep the pointer, not a copy)
+void trace_complete(uint32_t job, int track, const char* name, long long start_us, long long duration_us,
+                    long long bytes = -1);
+void trace_instant(uint32_t job, int track, const char* name, long long value = -1);
+
+// Writes every event we still have for `job`. False if the file can't be written.
+bool trace_dump(uint32_t job, const std::string& path);
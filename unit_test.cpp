@@ -0,0 +1,347 @@
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "download_cache.h"
+#include "downloader.h"
+#include "job_table.h"
+#include "resolve_stage.h"
+
+// --- Unit Tests ---
+// The pieces that don't need a server: bookkeeping, decisions, keys.
+// Each case returns "" when happy, or what went wrong.
+
+struct UnitCase {
+    std::string name;
+    std::function<std::string()> run;
+};
+
+// --- 1. Job Table ---
+static std::string state_is(const JobTable& table, uint64_t id, JobState state) {
+    JobStatus job;
+    if (!table.get(id, job)) return "job " + std::to_string(id) + " is gone";
+    if (job.state != state) return "job " + std::to_string(id) + " is " + job_state_name(job.state);
+    return "";
+}
+
+static void set(JobTable& table, uint64_t id, JobState state) {
+    table.update(id, [&](JobStatus& job) {
+        job.state = state;
+        return true;
+    });
+}
+
+static std::vector<uint64_t> ids_of(const std::vector<JobStatus>& jobs) {
+    std::vector<uint64_t> ids;
+    for (const JobStatus& job : jobs) ids.push_back(job.id);
+    return ids;
+}
+
+static std::vector<UnitCase> job_table_cases() {
+    return {
+        {"job table: add hands out consecutive ids", [] {
+             JobTable table;
+             uint64_t first = table.add({"a", "b", "c"});
+             if (table.add({"d"}) != first + 3) return std::string("the next batch doesn't follow on");
+             JobStatus job;
+             if (!table.get(first + 1, job) || job.url != "b" || job.state != JobState::Queued) {
+                 return std::string("the second job isn't b, queued");
+             }
+             if (table.get(first + 4, job)) return std::string("found a job that was never added");
+             return std::string();
+         }},
+        {"job table: update bumps the version only on a change", [] {
+             JobTable table;
+             uint64_t id = table.add({"a"});
+             JobStatus before, after;
+             table.get(id, before);
+             table.update(id, [](JobStatus&) { return false; });
+             table.get(id, after);
+             if (after.version != before.version) return std::string("an update that changed nothing moved the version");
+             table.update(id, [](JobStatus& job) {
+                 job.downloaded = 10;
+                 job.id = 99;
+                 return true;
+             });
+             table.get(id, after);
+             if (after.version <= before.version || after.downloaded != 10) return std::string("the change didn't land");
+             if (after.id != id) return std::string("update changed the id");
+             if (table.update(id + 1, [](JobStatus&) { return true; })) return std::string("updated an unknown job");
+             return std::string();
+         }},
+        {"job table: changed_since", [] {
+             JobTable table;
+             uint64_t first = table.add({"a", "b", "c"});
+             uint64_t version;
+             if (table.changed_since(0, version).size() != 3) return std::string("a fresh poll doesn't see every job");
+             if (!table.changed_since(version, version).empty()) return std::string("nothing changed, yet jobs came back");
+             set(table, first + 2, JobState::Downloading);
+             set(table, first, JobState::Downloading);
+             std::vector<uint64_t> ids = ids_of(table.changed_since(version, version));
+             if (ids != std::vector<uint64_t>{first + 2, first}) return std::string("expected c then a, oldest change first");
+             return std::string();
+         }},
+        {"job table: attach mirrors the job followed", [] {
+             JobTable table;
+             uint64_t a = table.add({"a", "b", "c"}), b = a + 1, c = a + 2;
+             if (!table.attach(b, a)) return std::string("couldn't attach");
+             if (table.attach(c, b)) return std::string("attached to a job that follows another");
+             if (table.attach(a, a)) return std::string("attached a job to itself");
+             table.update(a, [](JobStatus& job) {
+                 job.state = JobState::Done;
+                 job.output = "video_1.mp4";
+                 job.downloaded = job.total = 5;
+                 return true;
+             });
+             JobStatus job;
+             table.get(b, job);
+             if (job.same_as != a) return std::string("same_as isn't set");
+             if (job.state != JobState::Done || job.output != "video_1.mp4" || job.downloaded != 5) {
+                 return std::string("the follower didn't get the leader's state");
+             }
+             return state_is(table, c, JobState::Queued);
+         }},
+        {"job table: detach leaves the leader alone", [] {
+             JobTable table;
+             uint64_t a = table.add({"a", "b"}), b = a + 1;
+             table.attach(b, a);
+             if (table.detach(b) != a) return std::string("detach didn't say whom it followed");
+             if (table.detach(b) != 0) return std::string("detached twice");
+             if (table.sharing(a) != 1) return std::string("the leader still counts the follower");
+             set(table, b, JobState::Cancelled);
+             set(table, a, JobState::Downloading);
+             std::string problem = state_is(table, a, JobState::Downloading);
+             if (problem.empty()) problem = state_is(table, b, JobState::Cancelled);
+             return problem;
+         }},
+        {"job table: a withdrawn job carries on for its followers", [] {
+             JobTable table;
+             uint64_t a = table.add({"a", "b"}), b = a + 1;
+             if (table.withdraw(a)) return std::string("withdrew a job nothing follows");
+             table.attach(b, a);
+             set(table, a, JobState::Downloading);
+             if (!table.withdraw(a)) return std::string("couldn't withdraw");
+             if (table.sharing(a) != 1 || table.abandoned(a)) return std::string("the follower doesn't count");
+             set(table, a, JobState::Done);
+             JobStatus transfer;
+             table.transfer(a, transfer);
+             if (transfer.state != JobState::Done) return std::string("the transfer didn't finish");
+             std::string problem = state_is(table, a, JobState::Cancelled);
+             if (problem.empty()) problem = state_is(table, b, JobState::Done);
+             return problem;
+         }},
+        {"job table: a withdrawn job with no followers left is abandoned", [] {
+             JobTable table;
+             uint64_t a = table.add({"a", "b"}), b = a + 1;
+             table.attach(b, a);
+             set(table, a, JobState::Downloading);
+             table.withdraw(a);
+             table.detach(b);
+             if (!table.abandoned(a)) return std::string("nobody wants it, yet it isn't abandoned");
+             set(table, a, JobState::Cancelled);
+             if (table.abandoned(a)) return std::string("still abandoned once stopped");
+             return std::string();
+         }},
+        {"job table: forget_finished keeps the newest and the running", [] {
+             JobTable table(2);
+             uint64_t first = table.add({"a", "b", "c", "d", "e"});
+             set(table, first + 4, JobState::Downloading);
+             for (uint64_t id = first; id < first + 4; id++) set(table, id, JobState::Done);
+             JobStatus job;
+             if (table.get(first, job) || table.get(first + 1, job)) return std::string("the oldest finished jobs are still there");
+             if (!table.get(first + 2, job) || !table.get(first + 3, job)) return std::string("forgot too many");
+             if (!table.get(first + 4, job)) return std::string("forgot a running job");
+             return std::string();
+         }},
+        {"job table: forget_finished keeps a withdrawn job's transfer", [] {
+             JobTable table(0);
+             uint64_t a = table.add({"a", "b"}), b = a + 1;
+             table.attach(b, a);
+             set(table, a, JobState::Downloading);
+             table.withdraw(a);
+             JobStatus job;
+             if (!table.get(a, job)) return std::string("forgot a job whose transfer still runs");
+             set(table, a, JobState::Done);
+             if (table.get(a, job) || table.get(b, job)) return std::string("kept them once done");
+             return std::string();
+         }},
+    };
+}
+
+// --- 2. Job Controls ---
+static std::string step_is(JobControl control, JobState state, bool running, bool stashed, ControlStep expected) {
+    ControlStep step = control_step(control, state, running, stashed);
+    if (step == expected) return "";
+    return std::string(control == JobControl::Pause ? "pause" : control == JobControl::Resume ? "resume" : "cancel") +
+           " of a " + job_state_name(state) + " job took step " + std::to_string(static_cast<int>(step)) +
+           ", not " + std::to_string(static_cast<int>(expected));
+}
+
+static std::vector<UnitCase> control_cases() {
+    using S = JobState;
+    using C = ControlStep;
+    struct Expect {
+        JobControl control;
+        JobState state;
+        bool running, stashed;
+        ControlStep step;
+    };
+    auto all_of = [](const std::vector<Expect>& expects) {
+        for (const Expect& e : expects) {
+            std::string problem = step_is(e.control, e.state, e.running, e.stashed, e.step);
+            if (!problem.empty()) return problem;
+        }
+        return std::string();
+    };
+    return {
+        {"controls: pause", [=] {
+             return all_of({{JobControl::Pause, S::Queued, false, false, C::MarkPaused},
+                            {JobControl::Pause, S::Downloading, true, false, C::PauseDownload},
+                            {JobControl::Pause, S::Paused, false, false, C::None},
+                            {JobControl::Pause, S::Paused, false, true, C::None},
+                            {JobControl::Pause, S::Done, false, false, C::Refuse},
+                            {JobControl::Pause, S::Cancelled, false, false, C::Refuse}});
+         }},
+        {"controls: resume", [=] {
+             return all_of({{JobControl::Resume, S::Queued, false, false, C::None},
+                            {JobControl::Resume, S::Paused, false, true, C::Requeue},
+                            {JobControl::Resume, S::Paused, false, false, C::MarkQueued},
+                            {JobControl::Resume, S::Downloading, true, false, C::ResumeDownload},
+                            {JobControl::Resume, S::Failed, false, false, C::Refuse},
+                            {JobControl::Resume, S::Cancelled, false, false, C::Refuse}});
+         }},
+        {"controls: cancel", [=] {
+             return all_of({{JobControl::Cancel, S::Queued, false, false, C::MarkCancelled},
+                            {JobControl::Cancel, S::Paused, false, true, C::MarkCancelled},
+                            {JobControl::Cancel, S::Downloading, true, false, C::CancelDownload},
+                            {JobControl::Cancel, S::Cancelled, false, false, C::None},
+                            {JobControl::Cancel, S::Done, false, false, C::Refuse},
+                            {JobControl::Cancel, S::Failed, false, false, C::Refuse}});
+         }},
+        {"controls: a download the worker hasn't started yet", [=] {
+             // Marked downloading but not in started_downloads: nothing to stop yet
+             return all_of({{JobControl::Pause, S::Downloading, false, false, C::Refuse},
+                            {JobControl::Cancel, S::Downloading, false, false, C::Refuse}});
+         }},
+        {"controls: a resumed job drops its probes and re-resolves expired links", [] {
+             std::string fresh = "http://cdn.test/v.mp4?expire=4000000000";
+             auto resolver = std::make_shared<StubResolver>(std::map<std::string, std::vector<std::string>>{
+                 {"page", {fresh}}});
+             ResolveStage stage(resolver, 1, 1, 0, [](const std::string&, const std::string&) { return false; });
+             auto probe = std::make_shared<ProbeResult>();
+
+             // Paused while queued long enough for its link to run out
+             stage.requeue({1, "page", {"http://cdn.test/v.mp4?expire=1"}, {probe}, ""});
+             ResolvedJob job;
+             stage.pop(job);
+             if (job.links != std::vector<std::string>{fresh}) return "resumed with " + job.links[0];
+             stage.requeue({2, "page", {fresh}, {probe}, ""});
+             stage.pop(job);
+             if (job.id != 2 || job.links != std::vector<std::string>{fresh}) return std::string("a live link was resolved again");
+             if (!job.probes.empty()) return std::string("kept a stale probe");
+             return std::string();
+         }},
+    };
+}
+
+// --- 3. Duplicate Keys ---
+static std::string same_key(const std::string& a, const std::string& b) {
+    if (url_key(a) == url_key(b)) return "";
+    return a + " and " + b + " got different keys: " + url_key(a) + " / " + url_key(b);
+}
+
+static std::string different_key(const std::string& a, const std::string& b) {
+    if (url_key(a) != url_key(b)) return "";
+    return a + " and " + b + " share the key " + url_key(a);
+}
+
+static std::vector<UnitCase> dedup_cases() {
+    auto first_problem = [](const std::vector<std::string>& problems) {
+        for (const std::string& problem : problems) {
+            if (!problem.empty()) return problem;
+        }
+        return std::string();
+    };
+    return {
+        {"dedup: default ports", [=] {
+             return first_problem({same_key("http://example.com:80/a", "http://example.com/a"),
+                                   same_key("https://example.com:443/a", "https://example.com/a"),
+                                   different_key("http://example.com:8080/a", "http://example.com/a"),
+                                   different_key("https://example.com:80/a", "https://example.com/a")});
+         }},
+        {"dedup: case", [=] {
+             // Scheme and host don't care; the path and query might
+             return first_problem({same_key("HTTP://Example.COM/a", "http://example.com/a"),
+                                   different_key("http://example.com/A", "http://example.com/a"),
+                                   different_key("http://example.com/a?v=X", "http://example.com/a?v=x")});
+         }},
+        {"dedup: fragments", [=] {
+             return first_problem({same_key("http://example.com/a#t=30", "http://example.com/a"),
+                                   different_key("http://example.com/a?t=30", "http://example.com/a")});
+         }},
+        {"dedup: dots", [=] {
+             return first_problem({same_key("http://example.com/x/../a", "http://example.com/a"),
+                                   same_key("http://example.com/./x/./a", "http://example.com/x/a"),
+                                   different_key("http://example.com/x/a", "http://example.com/a")});
+         }},
+        {"dedup: unparseable URLs are their own key", [=] {
+             if (normalize_url("not a url") != "not a url") return "came back as " + normalize_url("not a url");
+             return different_key("not a url", "not  a url");
+         }},
+        {"dedup: links keys", [] {
+             std::string key = links_key({"http://cdn.example.com:80/v.mp4", "HTTP://CDN.example.com/a.m4a#x"});
+             if (key != links_key({"http://cdn.example.com/v.mp4", "http://cdn.example.com/a.m4a"})) {
+                 return "spellings of the same links got " + key;
+             }
+             // Video then audio is a different download from the audio alone
+             if (key == links_key({"http://cdn.example.com/v.mp4"})) return std::string("dropped a link");
+             if (key == url_key("http://cdn.example.com/v.mp4")) return std::string("a links key matched a URL key");
+             return std::string();
+         }},
+        {"dedup: a page's download key outlives its links", [] {
+             // What a job's single file is cached under: two resolves of one page sign different links
+             std::string key = download_key("https://Video.test/watch?v=x#t=3", "18");
+             if (key != download_key("https://video.test/watch?v=x", "18")) return "spellings of the page got " + key;
+             if (key == download_key("https://video.test/watch?v=x", "22")) return std::string("the format doesn't count");
+             if (normalize_url(key) != key) return "the cache would file it as " + normalize_url(key);
+
+             char dir_template[] = "/tmp/unit_test_XXXXXX";
+             std::string dir = mkdtemp(dir_template);
+             std::string output = dir + "/video.mp4", copy = dir + "/previous";
+             std::ofstream(output) << "first resolve";
+             std::string problem;
+             {
+                 DownloadCache cache(dir + "/cache", 1 << 20);
+                 if (!cache.store({{key, "\"v1\"", ""}}, output)) problem = "could not store";
+                 auto previous = cache.previous(download_key("https://video.test/watch?v=x", "18"), copy);
+                 if (problem.empty() && (!previous || previous->etag != "\"v1\"")) problem = "the second resolve missed";
+             }
+             std::string cleanup = "rm -rf '" + dir + "'";
+             if (std::system(cleanup.c_str()) != 0) problem = "could not clean up " + dir;
+             return problem;
+         }},
+    };
+}
+
+int main() {
+    std::vector<UnitCase> cases;
+    for (auto group : {job_table_cases, control_cases, dedup_cases}) {
+        std::vector<UnitCase> more = group();
+        cases.insert(cases.end(), more.begin(), more.end());
+    }
+
+    int failed = 0;
+    for (const UnitCase& test : cases) {
+        std::string problem = test.run();
+        std::cout << (problem.empty() ? "[ OK ] " : "[FAIL] ") << test.name;
+        if (!problem.empty()) std::cout << ": " << problem;
+        std::cout << "\n";
+        if (!problem.empty()) failed++;
+    }
+    std::cout << "\n" << cases.size() - failed << "/" << cases.size() << " passed\n";
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,172 @@
+#include "web_server.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <dirent.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <set>
+#include <strings.h>
+#include <sys/socket.h>
+#include <thread>
+#include "crow_all.h"
+
+// --- 1. Requests ---
+std::string WebRequest::header(const std::string& name) const {
+    for (const auto& header : headers) {
+        if (strcasecmp(header.first.c_str(), name.c_str()) == 0) return header.second;
+    }
+    return "";
+}
+
+std::string WebRequest::query(const std::string& name) const {
+    crow::query_string params(raw_url);
+    const char* value = params.get(name);
+    return value ? value : "";
+}
+
+std::string WebRequest::form(const std::string& name) const {
+    // Same encoding as a query string (http%3A%2F%2F...), so crow's parser decodes it for us
+    crow::query_string fields("?" + body);
+    const char* value = fields.get(name);
+    return value ? value : "";
+}
+
+bool WebRequest::json_strings(const std::string& key, std::vector<std::string>& out, std::string& error) const {
+    crow::json::rvalue document = crow::json::load(body);
+    if (!document) {
+        error = "Body is not valid JSON";
+        return false;
+    }
+    crow::json::rvalue list = document;
+    if (document.t() == crow::json::type::Object) {
+        if (!document.has(key)) {
+            error = "Expected a \"" + key + "\" list";
+            return false;
+        }
+        list = document[key];
+    }
+    if (list.t() != crow::json::type::List) {
+        error = "Expected a list";
+        return false;
+    }
+    out.clear();
+    out.reserve(list.size());
+    for (size_t i = 0; i < list.size(); i++) {
+        if (list[i].t() != crow::json::type::String) {
+            error = "Entry " + std::to_string(i) + " is not a string";
+            return false;
+        }
+        out.push_back(list[i].s());
+    }
+    return true;
+}
+
+std::string json_quote(const std::string& text) { return "\"" + crow::json::escape(text) + "\""; }
+
+static WebRequest to_web_request(const crow::request& req) {
+    WebRequest request;
+    request.method = crow::method_name(req.method);
+    request.path = req.url;
+    request.raw_url = req.raw_url;
+    request.body = req.body;
+    for (const auto& header : req.headers) request.headers.emplace_back(header.first, header.second);
+    return request;
+}
+
+static crow::response to_crow_response(const WebResponse& response) {
+    crow::response res(response.code, response.body);
+    res.set_header("Content-Type", response.content_type);
+    for (const auto& header : response.headers) res.add_header(header.first, header.second);
+    return res;
+}
+
+// asio sends at most 16 buffers per sendmsg and Crow builds a response out of
+// ~18, so on a kept-alive connection the body trails the headers in a second
+// small segment that Nagle holds until the client's delayed ACK: 40 ms per
+// request. Crow has no hook on its sockets (its acceptor is private and the
+// socket adaptor is fixed), but Linux hands TCP_NODELAY down from the
+// listening socket to every connection it accepts. So the listener is found
+// by elimination: a socket that wasn't open before the server started,
+// listening on its port.
+static std::set<int> open_fds() {
+    std::set<int> fds;
+    if (DIR* dir = opendir("/proc/self/fd")) {
+        while (dirent* entry = readdir(dir)) {
+            if (entry->d_name[0] != '.') fds.insert(std::atoi(entry->d_name));
+        }
+        closedir(dir);
+    }
+    return fds;
+}
+
+static void disable_nagle_on_listener(int port, const std::set<int>& open_before) {
+    for (int fd : open_fds()) {
+        if (open_before.count(fd)) continue;
+        sockaddr_storage addr;
+        socklen_t len = sizeof(addr);
+        int listening = 0;
+        socklen_t listening_len = sizeof(listening);
+        if (getsockname(fd, (sockaddr*)&addr, &len) != 0) continue;
+        if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &listening_len) != 0 || !listening) continue;
+        int bound = addr.ss_family == AF_INET    ? ntohs(((sockaddr_in*)&addr)->sin_port)
+                    : addr.ss_family == AF_INET6 ? ntohs(((sockaddr_in6*)&addr)->sin6_port)
+                                                 : -1;
+        if (bound != port) continue;
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+}
+
+// --- 2. Routing ---
+void WebServer::route(const std::string& method, const std::string& path, Handler handler) {
+    routes_.push_back({method, path, std::move(handler)});
+}
+
+void WebServer::run(const WebServerOptions& options) {
+    crow::SimpleApp app;
+    for (const Route& route : routes_) {
+        Handler handler = route.handler;
+        crow::DynamicRule& rule = app.route_dynamic(std::string(route.path));
+        rule.methods(method_from_string(route.method.c_str()));
+
+        // Crow checks the handler's arguments against the rule's parameters at runtime
+        if (route.path.find("<string>") != std::string::npos) {
+            rule([handler](const crow::request& req, std::string param) {
+                WebRequest request = to_web_request(req);
+                request.param = std::move(param);
+                return to_crow_response(handler(request));
+            });
+        } else {
+            rule([handler](const crow::request& req) { return to_crow_response(handler(to_web_request(req))); });
+        }
+    }
+
+    int threads = options.threads > 0 ? options.threads : (int)std::thread::hardware_concurrency();
+    app.loglevel(options.log_requests ? crow::LogLevel::Info : crow::LogLevel::Warning);
+
+    // Waits for the listener. Woken up and joined on every way out, so it
+    // never outlives `app` (run() throws when the port can't be bound).
+    std::atomic<bool> stopped{false};
+    std::set<int> open_before = open_fds();
+    std::thread nagle([&app, &stopped, &open_before, port = options.port] {
+        app.wait_for_server_start();
+        if (!stopped) disable_nagle_on_listener(port, open_before);
+    });
+    auto stop_nagle = [&] {
+        stopped = true;
+        app.notify_server_start();
+        nagle.join();
+    };
+    try {
+        app.port(options.port)
+            .concurrency(std::min(std::max(threads, 1), 65535))
+            .timeout(std::min(std::max(options.idle_timeout, 1), 255))
+            .run();
+    } catch (...) {
+        stop_nagle();
+        throw;
+    }
+    stop_nagle();
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+// --- Web Server ---
+// The one place that includes crow_all.h. Crow and asio are a 12k-line
+// header that takes most of a minute to compile, so handlers talk to this
+// thin interface instead; editing them rebuilds in seconds.
+
+struct WebRequest {
+    std::string method; // "GET", "POST", ...
+    std::string path;   // without the query string
+    std::string raw_url;
+    std::string body;
+    std::string param;  // what the route's <string> matched, if it has one
+    std::vector<std::pair<std::string, std::string>> headers;
+
+    // "" when missing. Names are case-insensitive.
+    std::string header(const std::string& name) const;
+    // Decoded query string parameter, "" when missing
+    std::string query(const std::string& name) const;
+    // Decoded field of an application/x-www-form-urlencoded body, "" when missing
+    std::string form(const std::string& name) const;
+    // The body as a JSON list of strings: the whole document, or its member
+    // `key` if it is an object. False, and why in `error`, for anything else.
+    bool json_strings(const std::string& key, std::vector<std::string>& out, std::string& error) const;
+};
+
+// `text` as a JSON string literal, quotes included, for replies written by hand
+std::string json_quote(const std::string& text);
+
+struct WebResponse {
+    int code = 200;
+    std::string body;
+    std::string content_type = "text/html; charset=utf-8";
+    std::vector<std::pair<std::string, std::string>> headers;
+
+    WebResponse() = default;
+    WebResponse(std::string body) : body(std::move(body)) {}
+    WebResponse(int code, std::string body) : code(code), body(std::move(body)) {}
+    WebResponse(int code, std::string body, std::string content_type)
+        : code(code), body(std::move(body)), content_type(std::move(content_type)) {}
+};
+
+struct WebServerOptions {
+    int port = 18080;
+    int threads = 0;          // I/O threads; 0 = one per core (Crow runs at least 2)
+    int idle_timeout = 5;     // seconds an idle keep-alive connection stays open, 1-255
+    // Crow logs two lines per request at its default level, which costs more
+    // than most of our handlers do. Off unless asked for.
+    bool log_requests = false;
+};
+
+class WebServer {
+public:
+    using Handler = std::function<WebResponse(const WebRequest&)>;
+
+    // `path` is a Crow rule and may end in one <string>, e.g. "/jobs/<string>";
+    // the match arrives in WebRequest::param. Handlers run on the server's threads.
+    void route(const std::string& method, const std::string& path, Handler handler);
+
+    // Serves until the process is stopped
+    void run(const WebServerOptions& options);
+
+private:
+    struct Route {
+        std::string method;
+        std::string path;
+        Handler handler;
+    };
+    std::vector<Route> routes_;
+};
@@ -1,117 +1,633 @@
-#include "crow_all.h"
+#include <chrono>
+#include <condition_variable>
 #include <cstdlib>
 #include <iostream>
-#include <queue>
-#include <thread>
+#include <memory>
 #include <mutex>
-#include <condition_variable>
+#include <thread>
 #include <string>
+#include <unordered_map>
+#include <vector>
+#include "assets.h"
+#include "dns_cache.h"
+#include "download_cache.h"
+#include "downloader.h"
+#include "job_table.h"
+#include "media.h"
+#include "metrics.h"
+#include "resolve_stage.h"
+#include "resolver.h"
+#include "task_pool.h"
+#include "web_server.h"
 
 // --- SAFE QUEUE SYSTEM ---
-std::queue<std::string> job_queue;
-std::mutex queue_mutex;
-std::condition_variable queue_cv;
-bool running = true;
+// Jobs wait in the resolve stage, which extracts and probes the next few
+// links while the current download runs.
+constexpr int RESOLVE_WORKERS = 4;
+constexpr size_t RESOLVE_LOOKAHEAD = 8;
+std::unique_ptr<ResolveStage> resolve_stage;
+
+// What /jobs reports: every job from the moment it is accepted
+JobTable job_table;
+
+// Queueing runs here rather than on the web server's threads, so a 10k-URL
+// batch never holds up the next request on the same I/O thread.
+std::unique_ptr<TaskPool> bookkeeping;
+
+// Everything goes in under one lock, however many URLs there are, so a big
+// batch doesn't fight the resolvers for it once per link.
+// The URLs got consecutive ids from job_table, starting at first_id.
+size_t enqueue_jobs(const std::vector<std::string>& urls, uint64_t first_id) {
+    std::vector<QueuedJob> queued;
+    queued.reserve(urls.size());
+    for (size_t i = 0; i < urls.size(); i++) queued.push_back({first_id + i, urls[i]});
+    size_t depth = resolve_stage->push(queued);
+    metrics_gauge_set(MetricGauge::QueueDepth, depth);
+
+    // Resolve the hosts while the jobs wait, so nobody blocks on DNS at the front of the queue
+    for (const std::string& url : urls) dns_prefetch(url_host(url));
+    return depth;
+}
+
+// --- DOWNLOAD CACHE ---
+// Off unless --cache-dir is given. Finished downloads are hashed and filed
+// on their own thread, so the slot can start the next job meanwhile.
+std::unique_ptr<DownloadCache> download_cache;
+std::unique_ptr<TaskPool> cache_writer;
+// With --piece-manifest-suffix, a changed file asks for <url><suffix> to fetch only the pieces that differ
+std::string piece_manifest_suffix;
+// The resolver's format, for download_key(): set once in main
+std::string resolver_format;
+
+static std::string manifest_url(const std::string& url) {
+    size_t query = url.find_first_of("?#");
+    if (query == std::string::npos) return url + piece_manifest_suffix;
+    return url.substr(0, query) + piece_manifest_suffix + url.substr(query);
+}
+
+// Bumps the job's version only when the numbers moved, so idle jobs don't
+// show up in every /jobs?since= poll
+static void publish_progress(uint64_t id, const MediaDownload& download) {
+    long long downloaded = download.downloaded();
+    long long total = download.total_size();
+    job_table.update(id, [&](JobStatus& job) {
+        if (job.downloaded == downloaded && job.total == total) return false;
+        job.downloaded = downloaded;
+        job.total = total;
+        return true;
+    });
+}
+
+static std::string output_name(uint64_t id) { return "video_" + std::to_string(id) + ".mp4"; }
+// Where a job keeps the cached copy it refreshes (DownloadOptions::previous)
+static std::string previous_copy_path(const std::string& output) { return output + ".previous"; }
+
+// {"id":1,"url":"...","state":"downloading",...}
+static std::string job_json(const JobStatus& job) {
+    std::string out = "{\"id\":" + std::to_string(job.id) + ",\"url\":" + json_quote(job.url) +
+                      ",\"state\":\"" + job_state_name(job.state) + "\",\"downloaded\":" +
+                      std::to_string(job.downloaded) + ",\"total\":" + std::to_string(job.total) +
+                      ",\"version\":" + std::to_string(job.version);
+    if (!job.output.empty()) out += ",\"output\":" + json_quote(job.output);
+    if (!job.error.empty()) out += ",\"error\":" + json_quote(job.error);
+    if (job.same_as) out += ",\"same_as\":" + std::to_string(job.same_as);
+    return out + "}";
+}
+
+// --- JOB CONTROLS ---
+// Pause, resume and cancel come in on the web server's threads while the
+// worker owns the download. Both sides decide under control_mutex, so a job
+// is never half way between two states. A paused download stays here with
+// its finished ranges on disk; resuming puts it back at the front of the line.
+std::mutex control_mutex;
+std::unordered_map<uint64_t, std::shared_ptr<MediaDownload>> started_downloads; // running or paused
+std::unordered_map<uint64_t, ResolvedJob> paused_jobs;                          // popped, waiting for resume
+
+static void set_state(uint64_t id, JobState state) {
+    job_table.update(id, [&](JobStatus& status) {
+        if (status.state == state) return false;
+        status.state = state;
+        if (state == JobState::Cancelled) status.output.clear();
+        return true;
+    });
+}
+
+// A paused download's part files go with it. Runs the cancelled download off
+// the caller's thread; with nothing left to fetch it only deletes.
+static void discard_download(uint64_t id) {
+    auto it = started_downloads.find(id);
+    if (it == started_downloads.end()) return;
+    std::shared_ptr<MediaDownload> download = it->second;
+    started_downloads.erase(it);
+    download->cancel();
+    std::string previous = previous_copy_path(output_name(id));
+    bookkeeping->post([download, previous] {
+        download->run();
+        remove(previous.c_str());
+    });
+}
+
+// --- DUPLICATES ---
+// A URL that is already queued, running or paused doesn't start a second
+// download: whoever submits it again gets the job that has it. Two page URLs
+// that resolve to the same direct links (youtu.be/x and youtube.com/watch?v=x)
+// only show up as duplicates once resolved; the later job then follows the
+// earlier one in job_table and ends with the same output. Cancelling either
+// one only drops that job; the transfer stops once no job is left on it.
+// Entries go when the job finishes. Guarded by control_mutex.
+std::unordered_map<std::string, uint64_t> in_flight;                   // key -> job
+std::unordered_map<uint64_t, std::vector<std::string>> in_flight_keys; // job -> its keys
+
+// The job a submission with this key goes to, 0 for a new one. A job its
+// submitter cancelled while others still follow it doesn't take any: the new
+// job joins the transfer once it is resolved.
+static uint64_t in_flight_job(const std::string& key) {
+    auto same = in_flight.find(key);
+    JobStatus status;
+    if (same == in_flight.end() || !job_table.get(same->second, status)) return 0;
+    return status.state == JobState::Cancelled ? 0 : same->second;
+}
+
+static void track_in_flight(uint64_t id, const std::string& key) {
+    in_flight[key] = id;
+    in_flight_keys[id].push_back(key);
+}
+
+static void forget_in_flight(uint64_t id) {
+    auto keys = in_flight_keys.find(id);
+    if (keys == in_flight_keys.end()) return;
+    for (const std::string& key : keys->second) {
+        auto it = in_flight.find(key);
+        if (it != in_flight.end() && it->second == id) in_flight.erase(it); // not if resubmitted since
+    }
+    in_flight_keys.erase(keys);
+}
+
+// The job follows `to` from now on, and so do submissions of its URL
+static void attach_duplicate(uint64_t id, uint64_t to) {
+    job_table.attach(id, to);
+    auto keys = in_flight_keys.find(id);
+    if (keys == in_flight_keys.end()) return;
+    for (const std::string& key : keys->second) track_in_flight(to, key);
+    in_flight_keys.erase(keys);
+}
+
+// Stops the transfer `id` stands for (JobTable::transfer); false if it is
+// past stopping
+static bool cancel_transfer(uint64_t id) {
+    JobStatus transfer;
+    if (!job_table.transfer(id, transfer)) return false;
+    auto started = started_downloads.find(id);
+    bool running = transfer.state == JobState::Downloading && started != started_downloads.end();
+    switch (control_step(JobControl::Cancel, transfer.state, running, paused_jobs.count(id) > 0)) {
+        case ControlStep::MarkCancelled:
+            if (paused_jobs.erase(id)) discard_download(id);
+            set_state(id, JobState::Cancelled);
+            forget_in_flight(id);
+            return true;
+        case ControlStep::CancelDownload:
+            started->second->cancel();
+            return true;
+        case ControlStep::None:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Runs the download while /jobs watches it, a few times a second
+static DownloadResult run_with_progress(uint64_t id, MediaDownload& download) {
+    std::mutex ticker_mutex;
+    std::condition_variable ticker_cv;
+    bool finished = false;
+    std::thread ticker([&] {
+        std::unique_lock<std::mutex> lock(ticker_mutex);
+        while (!ticker_cv.wait_for(lock, std::chrono::milliseconds(250), [&] { return finished; })) {
+            publish_progress(id, download);
+        }
+    });
+    DownloadResult result = download.run();
+    {
+        std::lock_guard<std::mutex> lock(ticker_mutex);
+        finished = true;
+    }
+    ticker_cv.notify_one();
+    ticker.join();
+    publish_progress(id, download);
+    return result;
+}
+
+static void set_downloading(uint64_t id, const std::string& output) {
+    job_table.update(id, [&](JobStatus& status) {
+        status.state = JobState::Downloading;
+        status.output = output;
+        return true;
+    });
+}
 
 // --- THE WORKER THREAD (The Engine Driver) ---
-// This runs in the background forever. It waits for links and processes them one by one.
+// This runs in the background forever. It takes resolved jobs and downloads them one by one.
 void worker_thread_func() {
-    while (running) {
-        std::string url_to_download;
+    ResolvedJob job;
+
+    // 1. Wait for a job that is ready to go
+    while (resolve_stage->pop(job)) {
+        metrics_gauge_set(MetricGauge::QueueDepth, resolve_stage->waiting());
 
-        // 1. Wait for a job safely
+        // 2. RUN THE ENGINE (in this thread, so the web server never blocks)
+        // It runs in-process rather than through ./my_downloader so /metrics can see inside it.
+        std::shared_ptr<MediaDownload> download;
+        std::string output = output_name(job.id);
+        // Single files are cached by page URL: the links are signed anew on every resolve
+        std::string cache_key = download_key(job.url, resolver_format);
+        bool resumed = false;
         {
-            std::unique_lock<std::mutex> lock(queue_mutex);
-            queue_cv.wait(lock, []{ return !job_queue.empty() || !running; });
+            std::lock_guard<std::mutex> lock(control_mutex);
+            JobStatus status;
+            if (!job_table.transfer(job.id, status) || status.state == JobState::Cancelled) {
+                discard_download(job.id);
+                continue;
+            }
+            if (status.state == JobState::Paused) {
+                // Paused while it waited; it keeps its place in paused_jobs until resumed
+                paused_jobs[job.id] = std::move(job);
+                continue;
+            }
+            if (job.links.empty()) {
+                std::cout << "[Worker] " << job.error << "\n";
+                metrics_add(MetricCounter::JobsFailed);
+                job_table.update(job.id, [&](JobStatus& status) {
+                    status.state = JobState::Failed;
+                    status.error = job.error;
+                    return true;
+                });
+                discard_download(job.id); // resumed, but resolving it again failed
+                forget_in_flight(job.id);
+                continue;
+            }
 
-            if (!running && job_queue.empty()) return;
+            auto started = started_downloads.find(job.id);
+            if (started != started_downloads.end()) {
+                download = started->second; // resumed: carries on where it stopped
+                resumed = true;
+                set_downloading(job.id, output);
+            } else {
+                std::string key = links_key(job.links);
+                auto same = in_flight.find(key);
+                if (same != in_flight.end() && same->second != job.id) {
+                    std::cout << "[Worker] " << job.url << " is the same download as job " << same->second << "\n";
+                    attach_duplicate(job.id, same->second);
+                    continue;
+                }
+                track_in_flight(job.id, key);
+            }
+        }
 
-            url_to_download = job_queue.front();
-            job_queue.pop();
+        if (!resumed) {
+            // Set up without the lock: the cached copy below may be a full copy of a big file
+            DownloadOptions options;
+            options.output = output;
+            // Set DOWNLOADER_TRACE_DIR to get a Chrome trace of every job
+            if (const char* trace_dir = std::getenv("DOWNLOADER_TRACE_DIR")) {
+                options.trace_path = std::string(trace_dir) + "/job_" + std::to_string(job.id) + ".json";
+            }
+            // A single file the cache has goes out as a conditional request against the
+            // cached copy, and a changed one is refreshed piece by piece if it can be
+            if (download_cache && job.links.size() == 1) {
+                auto previous = download_cache->previous(cache_key, previous_copy_path(output));
+                if (previous && !piece_manifest_suffix.empty()) {
+                    previous->manifest_url = manifest_url(job.links[0]);
+                }
+                options.previous = previous;
+            }
+            // Video and audio come as separate links for the best qualities; they share the connections
+            download = std::make_shared<MediaDownload>(options, job.links, job.probes);
+
+            std::lock_guard<std::mutex> lock(control_mutex);
+            JobStatus status;
+            if (!job_table.transfer(job.id, status) || status.state != JobState::Queued) {
+                // Paused or cancelled meanwhile; a resume starts over from the top
+                remove(previous_copy_path(output).c_str());
+                if (status.state == JobState::Paused) paused_jobs[job.id] = std::move(job);
+                continue;
+            }
+            started_downloads[job.id] = download;
+            set_downloading(job.id, output);
+        }
+        std::cout << "[Worker] Starting download for: " << job.url << std::endl;
+
+        // 3. An earlier job's copy does, if the servers say it is still current (a
+        // single file asks for itself, see above)
+        bool fetch_cached = !resumed && download_cache && job.links.size() > 1;
+        long long cached = fetch_cached ? download_cache->fetch(job.links, output) : -1;
+        DownloadResult result;
+        if (cached >= 0) {
+            result.ok = true;
+            metrics_add(MetricCounter::JobsSucceeded);
+            job_table.update(job.id, [&](JobStatus& status) {
+                status.downloaded = status.total = cached;
+                return true;
+            });
+            std::cout << "[Worker] " << job.url << " was in the cache\n";
+        } else {
+            result = run_with_progress(job.id, *download);
         }
 
-        // 2. RUN YOUR ENGINE (Non-Blocking for the web server)
-        std::cout << "[Worker] Starting download for: " << url_to_download << std::endl;
-        
-        // We use specific quotes around the URL to prevent shell injection crashes
-        std::string command = "./my_downloader \"" + url_to_download + "\"";
-        
-        // Run the command and ignore output (or redirect to a log file)
-        int result = std::system(command.c_str());
-        
-        if(result == 0) std::cout << "[Worker] Success!\n";
-        else std::cout << "[Worker] Download failed or warned.\n";
+        std::lock_guard<std::mutex> lock(control_mutex);
+        if (result.paused) {
+            // The connections are closed already; the slot moves on to the next job
+            std::cout << "[Worker] Paused " << job.url << "\n";
+            set_state(job.id, JobState::Paused);
+            paused_jobs[job.id] = std::move(job);
+            continue;
+        }
+        started_downloads.erase(job.id);
+        forget_in_flight(job.id);
+        remove(previous_copy_path(output).c_str());
+        if (result.cancelled) {
+            std::cout << "[Worker] Cancelled " << job.url << "\n";
+            set_state(job.id, JobState::Cancelled);
+            continue;
+        }
+        job_table.update(job.id, [&](JobStatus& status) {
+            status.state = result.ok ? JobState::Done : JobState::Failed;
+            status.error = result.error;
+            if (!result.ok) status.output.clear();
+            return true;
+        });
+        if(result.ok) std::cout << "[Worker] Success! Saved as " << output << "\n";
+        else std::cout << "[Worker] Download failed: " << result.error << "\n";
+
+        if (download_cache && job.links.size() == 1) {
+            download_cache->used(cache_key, result.unchanged);
+        }
+        if (result.unchanged) std::cout << "[Worker] " << job.url << " hasn't changed since it was cached\n";
+        else if (result.ok && cached < 0 && download_cache) {
+            std::vector<CacheSource> sources;
+            std::vector<RemoteInfo> remote = download->sources();
+            for (size_t i = 0; i < job.links.size() && i < remote.size(); i++) {
+                // A single file by its page (see above); several go back to fetch(), which asks each link
+                std::string url = job.links.size() == 1 ? cache_key : job.links[i];
+                sources.push_back({url, remote[i].etag, remote[i].last_modified});
+            }
+            cache_writer->post([sources, output] { download_cache->store(sources, output); });
+        }
     }
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+    // Usage: webapp [--port 18080] [--threads N] [--idle-timeout S]
+    //               [--bookkeeping-threads N] [--log-requests]
+    //               [--cache-dir DIR] [--cache-size MB] [--piece-manifest-suffix .pieces]
+    WebServerOptions web;
+    int bookkeeping_threads = 1; // more than one may queue jobs out of submission order
+    std::string cache_dir;
+    long long cache_mb = 10240;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--port" && has_value) web.port = std::atoi(argv[++i]);
+        else if (arg == "--threads" && has_value) web.threads = std::atoi(argv[++i]);
+        else if (arg == "--idle-timeout" && has_value) web.idle_timeout = std::atoi(argv[++i]);
+        else if (arg == "--bookkeeping-threads" && has_value) bookkeeping_threads = std::atoi(argv[++i]);
+        else if (arg == "--log-requests") web.log_requests = true;
+        else if (arg == "--cache-dir" && has_value) cache_dir = argv[++i];
+        else if (arg == "--cache-size" && has_value) cache_mb = std::atoll(argv[++i]);
+        else if (arg == "--piece-manifest-suffix" && has_value) piece_manifest_suffix = argv[++i];
+        else {
+            std::cerr << "Unknown option: " << arg << "\n";
+            return 1;
+        }
+    }
+
+    // DOWNLOADER_RESOLVER=direct queues links to the files themselves, without yt-dlp
+    const char* resolver_name = std::getenv("DOWNLOADER_RESOLVER");
+    std::unique_ptr<LinkResolver> resolver = make_resolver(resolver_name ? resolver_name : "yt-dlp");
+    if (!resolver) {
+        std::cerr << "Unknown resolver: " << resolver_name << " (use yt-dlp or direct)\n";
+        return 1;
+    }
+    if (!cache_dir.empty()) {
+        download_cache = std::make_unique<DownloadCache>(cache_dir, cache_mb * 1024 * 1024);
+        cache_writer = std::make_unique<TaskPool>(1);
+    }
+    // A file the cache has is probed by its download, conditionally (see the worker)
+    auto probe_link = [](const std::string& url, const std::string&) {
+        return !download_cache || !download_cache->has(download_key(url, resolver_format));
+    };
+    resolver_format = resolver->format();
+    resolve_stage = std::make_unique<ResolveStage>(std::move(resolver), RESOLVE_WORKERS, RESOLVE_LOOKAHEAD,
+                                                   1 << 20, probe_link);
+    bookkeeping = std::make_unique<TaskPool>(bookkeeping_threads);
+
     // Start the background worker thread
     std::thread worker(worker_thread_func);
     worker.detach(); // Let it run independently
 
-    crow::SimpleApp app;
+    // Get yt-dlp's Python started before the first job needs a link
+    if (!resolver_name || std::string(resolver_name) == "yt-dlp") std::thread([]{ resolver_prewarm(2); }).detach();
+
+    WebServer server;
 
     // --- FRONTEND (The UI) ---
-    CROW_ROUTE(app, "/")([](){
-        return R"(
-            <html>
-            <head>
-                <title>Ultra-Fast Downloader</title>
-                <style>
-                    body { font-family: 'Segoe UI', sans-serif; background: #222; color: #fff; text-align: center; padding: 50px; }
-                    input { padding: 15px; width: 60%; border-radius: 5px; border: none; }
-                    button { padding: 15px 30px; background: #007bff; color: white; border: none; border-radius: 5px; cursor: pointer; font-weight: bold; }
-                    button:hover { background: #0056b3; }
-                    .status { margin-top: 20px; color: #aaa; }
-                </style>
-            </head>
-            <body>
-                <h1> C++ Download Engine</h1>
-                <form action="/add_job" method="POST">
-                    <input type="text" name="url" placeholder="Paste YouTube Link Here..." required>
-                    <button type="submit">Download</button>
-                </form>
-                <div class="status">Jobs are processed in the background terminal.</div>
-            </body>
-            </html>
-        )";
+    // Built into the binary from ui/, gzipped and with ETags; see assets.h
+    server.route("GET", "/", [](const WebRequest& req) { return asset_response(req, find_asset("index.html")); });
+    server.route("GET", "/static/<string>", [](const WebRequest& req) {
+        return asset_response(req, find_asset(req.param));
     });
 
     // --- BACKEND (The Linker) ---
-    CROW_ROUTE(app, "/add_job").methods(crow::HTTPMethod::POST)([](const crow::request& req){
-        // 1. Parse the URL (Manual parsing for simplicity)
-        std::string body = req.body;
-        std::string prefix = "url=";
-        std::string url = "";
-        
-        size_t pos = body.find(prefix);
-        if(pos != std::string::npos) {
-            url = body.substr(pos + prefix.length());
-            
-            // Decode URL symbols (simple version)
-            // Real browsers send http%3A%2F%2F instead of http://
-            // For a basic test, this is usually fine, but a real decoder is better.
-            // A quick hack to fix common encoding:
-            size_t replace_pos;
-            while ((replace_pos = url.find("%3A")) != std::string::npos) url.replace(replace_pos, 3, ":");
-            while ((replace_pos = url.find("%2F")) != std::string::npos) url.replace(replace_pos, 3, "/");
-            while ((replace_pos = url.find("%3F")) != std::string::npos) url.replace(replace_pos, 3, "?");
-            while ((replace_pos = url.find("%3D")) != std::string::npos) url.replace(replace_pos, 3, "=");
-            while ((replace_pos = url.find("%26")) != std::string::npos) url.replace(replace_pos, 3, "&");
-        }
+    server.route("POST", "/add_job", [](const WebRequest& req) {
+        // 1. Parse the form. Browsers send it percent-encoded (http%3A%2F%2F...).
+        std::string url = req.form("url");
 
-        if(url.empty()) return crow::response(400, "Invalid URL");
+        if(url.empty()) return WebResponse(400, "Invalid URL");
 
-        // 2. Add to Queue Safely
+        // 2. Add to Queue Safely (off this thread, see bookkeeping), unless it's there already
+        uint64_t id;
+        bool duplicate;
         {
-            std::lock_guard<std::mutex> lock(queue_mutex);
-            job_queue.push(url);
+            std::lock_guard<std::mutex> lock(control_mutex);
+            std::string key = url_key(url);
+            id = in_flight_job(key);
+            duplicate = id != 0;
+            if (!duplicate) {
+                id = job_table.add({url});
+                track_in_flight(id, key);
+            }
         }
-        queue_cv.notify_one(); // Wake up the worker
+        if (!duplicate) bookkeeping->post([url, id] { enqueue_jobs({url}, id); });
 
         // 3. Respond immediately (Don't wait for download!)
-        return crow::response("<h1>Job Added!</h1><p>The engine is downloading it in the background.</p><a href='/'>Go Back</a>");
+        std::string status = "/jobs/" + std::to_string(id);
+        std::string what = duplicate ? "Job " + std::to_string(id) + " already has it" : "Job " + std::to_string(id) + " Added!";
+        return WebResponse("<h1>" + what + "</h1><p>The engine is downloading it in the background. "
+                           "<a href='" + status + "'>Status</a></p><a href='/'>Go Back</a>");
+    });
+
+    // --- BATCH SUBMISSION ---
+    // POST a JSON list of URLs, either bare (["https://...", ...]) or as
+    // {"urls": [...]}. The whole batch is checked before anything is queued,
+    // so a bad entry never leaves half a manifest behind.
+    server.route("POST", "/jobs", [](const WebRequest& req) {
+        std::vector<std::string> urls;
+        std::string error;
+        if (!req.json_strings("urls", urls, error)) return WebResponse(400, error);
+        for (size_t i = 0; i < urls.size(); i++) {
+            // JSON strings arrive already unescaped; the URLs themselves stay as sent
+            if (urls[i].empty()) return WebResponse(400, "Entry " + std::to_string(i) + " is not a URL");
+        }
+        if (urls.empty()) return WebResponse(400, "No URLs given");
+
+        // URLs already in flight, or twice in this batch, go to the job that has them
+        std::vector<uint64_t> ids(urls.size());
+        std::vector<std::string> fresh;
+        uint64_t first_id = 0;
+        {
+            std::lock_guard<std::mutex> lock(control_mutex);
+            std::vector<std::string> fresh_keys;
+            std::vector<size_t> fresh_slot(urls.size(), SIZE_MAX); // into fresh
+            std::unordered_map<std::string, size_t> batch_slots;
+            for (size_t i = 0; i < urls.size(); i++) {
+                std::string key = url_key(urls[i]);
+                ids[i] = in_flight_job(key);
+                if (ids[i]) continue;
+                auto slot = batch_slots.emplace(key, fresh.size());
+                if (slot.second) {
+                    fresh.push_back(urls[i]);
+                    fresh_keys.push_back(key);
+                }
+                fresh_slot[i] = slot.first->second;
+            }
+            if (!fresh.empty()) first_id = job_table.add(fresh);
+            for (size_t i = 0; i < fresh.size(); i++) track_in_flight(first_id + i, fresh_keys[i]);
+            for (size_t i = 0; i < urls.size(); i++) {
+                if (fresh_slot[i] != SIZE_MAX) ids[i] = first_id + fresh_slot[i];
+            }
+        }
+
+        // Roughly what the queue holds once this batch is in; batches still on their way aren't counted
+        size_t depth = resolve_stage->waiting() + fresh.size();
+        size_t added = fresh.size();
+        if (!fresh.empty()) bookkeeping->post([fresh = std::move(fresh), first_id] { enqueue_jobs(fresh, first_id); });
+
+        // ids has each URL's job, in the order the URLs came; the new jobs run from first_id to last_id
+        std::string reply = "{\"accepted\":" + std::to_string(urls.size()) + ",\"new\":" + std::to_string(added);
+        if (added > 0) {
+            reply += ",\"first_id\":" + std::to_string(first_id) + ",\"last_id\":" + std::to_string(first_id + added - 1);
+        }
+        reply += ",\"ids\":[";
+        for (size_t i = 0; i < ids.size(); i++) reply += (i ? "," : "") + std::to_string(ids[i]);
+        reply += "],\"queue_depth\":" + std::to_string(depth) + "}";
+        return WebResponse(202, reply, "application/json");
+    });
+
+    // --- JOB STATUS ---
+    // GET /jobs?since=<version> lists the jobs that changed after that version,
+    // along with the version to ask from next time; without since, all of them.
+    // A poller keeps passing the version back and only ever sees what moved.
+    server.route("GET", "/jobs", [](const WebRequest& req) {
+        std::string since = req.query("since");
+        uint64_t version;
+        std::vector<JobStatus> changed = job_table.changed_since(std::strtoull(since.c_str(), nullptr, 10), version);
+
+        std::string body = "{\"version\":" + std::to_string(version) + ",\"jobs\":[";
+        for (size_t i = 0; i < changed.size(); i++) {
+            if (i > 0) body += ',';
+            body += job_json(changed[i]);
+        }
+        return WebResponse(200, body + "]}", "application/json");
+    });
+
+    server.route("GET", "/jobs/<string>", [](const WebRequest& req) {
+        char* end;
+        uint64_t id = std::strtoull(req.param.c_str(), &end, 10);
+        JobStatus job;
+        if (req.param.empty() || *end != '\0' || !job_table.get(id, job)) {
+            return WebResponse(404, "No such job");
+        }
+        return WebResponse(200, job_json(job), "application/json");
+    });
+
+    // POST /jobs/<id>/pause, /resume or /cancel. Answers with the job as it
+    // is now: a running download stops in a moment (its connections close
+    // straight away) and /jobs shows when it has. 409 when the job is past
+    // the point where that makes sense, e.g. cancelling a finished one.
+    auto job_control = [](JobControl control) {
+        return [control](const WebRequest& req) {
+            char* end;
+            uint64_t id = std::strtoull(req.param.c_str(), &end, 10);
+            std::lock_guard<std::mutex> lock(control_mutex);
+            JobStatus job;
+            if (req.param.empty() || *end != '\0' || !job_table.get(id, job)) {
+                return WebResponse(404, "No such job");
+            }
+            uint64_t asked = id;
+            // Finished, or withdrawn (below): nothing left but cancelling again
+            if (job.state == JobState::Done || job.state == JobState::Failed || job.state == JobState::Cancelled) {
+                if (control_step(control, job.state, false, false) == ControlStep::Refuse) {
+                    return WebResponse(409, "Job is " + std::string(job_state_name(job.state)));
+                }
+                return WebResponse(200, job_json(job), "application/json");
+            }
+            if (job.same_as) {
+                // A duplicate: cancelling it lets go of the transfer it shares,
+                // which stops only once no job wants it. Other controls work on
+                // the transfer.
+                if (control == JobControl::Cancel) {
+                    uint64_t leader = job_table.detach(id);
+                    set_state(id, JobState::Cancelled);
+                    if (job_table.abandoned(leader)) cancel_transfer(leader);
+                    job_table.get(asked, job);
+                    return WebResponse(200, job_json(job), "application/json");
+                }
+                id = job.same_as;
+            }
+            if (control == JobControl::Pause && job_table.sharing(id) > 1) {
+                return WebResponse(409, "Job shares its download with other jobs");
+            }
+            // Jobs follow this one: it drops out, the transfer carries on for them
+            if (control == JobControl::Cancel && job_table.withdraw(id)) {
+                job_table.get(asked, job);
+                return WebResponse(200, job_json(job), "application/json");
+            }
+
+            job_table.transfer(id, job);
+            if (control == JobControl::Cancel) {
+                if (!cancel_transfer(id)) return WebResponse(409, "Job is " + std::string(job_state_name(job.state)));
+                job_table.get(asked, job);
+                return WebResponse(200, job_json(job), "application/json");
+            }
+            auto started = started_downloads.find(id);
+            auto paused = paused_jobs.find(id);
+            bool running = job.state == JobState::Downloading && started != started_downloads.end();
+            switch (control_step(control, job.state, running, paused != paused_jobs.end())) {
+                case ControlStep::Refuse:
+                    return WebResponse(409, "Job is " + std::string(job_state_name(job.state)));
+                case ControlStep::MarkPaused: set_state(id, JobState::Paused); break;
+                case ControlStep::PauseDownload: started->second->pause(); break;
+                case ControlStep::MarkQueued: set_state(id, JobState::Queued); break;
+                case ControlStep::ResumeDownload: started->second->resume(); break;
+                case ControlStep::Requeue:
+                    if (started != started_downloads.end()) started->second->resume();
+                    set_state(id, JobState::Queued);
+                    resolve_stage->requeue(std::move(paused->second));
+                    paused_jobs.erase(paused);
+                    break;
+                default: break;
+            }
+            job_table.get(asked, job);
+            return WebResponse(200, job_json(job), "application/json");
+        };
+    };
+    server.route("POST", "/jobs/<string>/pause", job_control(JobControl::Pause));
+    server.route("POST", "/jobs/<string>/resume", job_control(JobControl::Resume));
+    server.route("POST", "/jobs/<string>/cancel", job_control(JobControl::Cancel));
+
+    // --- MONITORING (Prometheus scrapes this) ---
+    server.route("GET", "/metrics", [](const WebRequest&) {
+        return WebResponse(200, metrics_render(), "text/plain; version=0.0.4; charset=utf-8");
     });
 
-    app.port(18080).multithreaded().run();
+    server.run(web);
 }